@@ -0,0 +1,360 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "dbll.h"
+#include "poolalloc.h"
+
+/* benchmarks for the pool allocator
+
+   `pa_bench` runs the workload suite against a growable pool and
+   against the system malloc, then the free-cost table; `pa_bench NAME`
+   runs only the workloads whose name starts with NAME. */
+
+#define NSLOTS 4096
+#define NOPS 200000
+#define NTHREADS 4
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Cost of mpool_free as fragmentation grows: `nfree` free blocks are
+   left scattered between live ones, then a tenth of the live blocks are
+   freed, each merging with its free neighbours. Every free does the
+   same work whatever `nfree` is, a tag lookup and two merges, but not
+   in the same time: in random order each one misses the cache on block
+   records spread over a working set that grows with `nfree`. `shuffle`
+   0 frees in address order, which leaves only the misses in the tag
+   table, whose slots are hashed. */
+static double bench_free_frag(size_t nfree, int shuffle) {
+  struct memory_pool *p;
+  char **blocks;
+  size_t n = 2 * nfree + 1, nops = nfree / 10, i, j, tmp;
+  size_t *order;
+  double t;
+
+  p = mpool_create(n * 64);
+  blocks = calloc(n, sizeof(char *));
+  order = calloc(nfree, sizeof(size_t));
+  for(i = 0; i < n; i++)
+	blocks[i] = mpool_alloc(p, 64);
+  for(i = 0; i < n; i += 2)
+	mpool_free(p, blocks[i]);
+
+  srand(1);
+  for(i = 0; i < nfree; i++)
+	order[i] = 2 * i + 1;
+  for(i = nfree - 1; shuffle && i > 0; i--) {
+	j = rand() % (i + 1);
+	tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+  }
+
+  t = now_ns();
+  for(i = 0; i < nops; i++)
+	mpool_free(p, blocks[order[i]]);
+  t = now_ns() - t;
+
+  free(order);
+  free(blocks);
+  mpool_destroy(p);
+  return t / nops;
+}
+
+/* an allocator under test; `held` is the memory it holds from the OS */
+struct allocator {
+  const char *name;
+  void (*setup)(void);
+  void (*teardown)(void);
+  void *(*alloc)(size_t size);
+  void (*free)(void *addr);
+  size_t (*held)(void);
+  void (*thread_done)(void);  /* called by each worker thread as it finishes */
+};
+
+static struct memory_pool *pool;
+
+static void pool_setup(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GROW, 0 };
+  pool = mpool_create_opts(1 << 20, &opts);
+}
+static void small_setup(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GROW | MPOOL_SMALL, 0 };
+  pool = mpool_create_opts(1 << 20, &opts);
+}
+static void defer_setup(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GROW | MPOOL_DEFER, 0 };
+  pool = mpool_create_opts(1 << 20, &opts);
+  mpool_maintain_start(pool, 1);
+}
+static void guard_setup(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GROW | MPOOL_GUARD, 0, 0 };
+  pool = mpool_create_opts(1 << 20, &opts);
+}
+static void pool_teardown(void) { mpool_destroy(pool); }
+static void *pool_alloc_fn(size_t size) { return mpool_alloc(pool, size); }
+static void pool_free_fn(void *addr) { mpool_free(pool, addr); }
+
+/* the same pool behind a tcache per thread, made on first use */
+static __thread struct mpool_tcache *tcache;
+
+static struct mpool_tcache *get_tcache(void) {
+  if(!tcache) tcache = mpool_tcache_create(pool);
+  return tcache;
+}
+static void *tcache_alloc_fn(size_t size) { return mpool_tcache_alloc(get_tcache(), size); }
+static void tcache_free_fn(void *addr) { mpool_tcache_free(get_tcache(), addr); }
+static void tcache_done(void) {
+  if(tcache) mpool_tcache_destroy(tcache);
+  tcache = NULL;
+}
+static void tcache_teardown(void) {
+  tcache_done();
+  mpool_destroy(pool);
+}
+
+static size_t pool_held(void) {
+  struct mpool_arena *arena;
+  size_t held = 0;
+
+  for(arena = pool->arenas; arena; arena = arena->next)
+	held += arena->committed;
+  return held;
+}
+
+static void nop(void) {}
+
+static size_t malloc_held(void) {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena + mi.hblkhd;
+}
+
+static struct allocator allocators[] = {
+  { "poolalloc", pool_setup, pool_teardown, pool_alloc_fn, pool_free_fn, pool_held },
+  { "pool-small", small_setup, pool_teardown, pool_alloc_fn, pool_free_fn, pool_held },
+  { "pool-defer", defer_setup, pool_teardown, pool_alloc_fn, pool_free_fn, pool_held },
+  { "pool-guard", guard_setup, pool_teardown, pool_alloc_fn, pool_free_fn, pool_held },
+  { "pool-tcache", pool_setup, tcache_teardown, tcache_alloc_fn, tcache_free_fn, pool_held, tcache_done },
+  { "malloc", nop, nop, malloc, free, malloc_held },
+};
+
+/* one thread's run of a workload: a table of slots that may hold an
+   allocation, and the latency of every call made */
+struct run {
+  struct allocator *a;
+  void *slots[NSLOTS];
+  size_t sizes[NSLOTS];
+  double *lat;
+  size_t nlat;
+  unsigned seed;
+};
+
+static unsigned next_rand(unsigned *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16;
+}
+
+static void do_alloc(struct run *r, size_t k, size_t size) {
+  double t = now_ns();
+  r->slots[k] = r->a->alloc(size);
+  r->lat[r->nlat++] = now_ns() - t;
+  r->sizes[k] = r->slots[k] ? size : 0;
+  if(r->slots[k]) *(char *) r->slots[k] = 1;
+}
+
+static void do_free(struct run *r, size_t k) {
+  double t = now_ns();
+  r->a->free(r->slots[k]);
+  r->lat[r->nlat++] = now_ns() - t;
+  r->slots[k] = NULL;
+  r->sizes[k] = 0;
+}
+
+static size_t uniform_size(unsigned *seed) {
+  return 16 + next_rand(seed) % 113;
+}
+
+/* sizes with a power-law tail: mostly small, occasionally up to 64 KiB */
+static size_t powerlaw_size(unsigned *seed) {
+  double u = (next_rand(seed) % 32767 + 1) / 32768.0;
+  double size = 16 / pow(u, 1 / 1.2);
+  return size < 65536 ? (size_t) size : 65536;
+}
+
+/* random slots are allocated when empty and freed when full */
+static void churn(struct run *r, size_t (*size)(unsigned *)) {
+  size_t k;
+
+  while(r->nlat < NOPS) {
+	k = next_rand(&r->seed) % NSLOTS;
+	if(r->slots[k]) do_free(r, k);
+	else do_alloc(r, k, size(&r->seed));
+  }
+}
+
+static void wl_uniform(struct run *r) { churn(r, uniform_size); }
+static void wl_powerlaw(struct run *r) { churn(r, powerlaw_size); }
+
+/* a stack that grows and shrinks at random: frees are always of the
+   most recent allocation */
+static void wl_lifo(struct run *r) {
+  size_t top = 0;
+
+  while(r->nlat < NOPS) {
+	if(top < NSLOTS && (top == 0 || next_rand(&r->seed) % 2))
+	  do_alloc(r, top++, 16 + next_rand(&r->seed) % 241);
+	else
+	  do_free(r, --top);
+  }
+}
+
+/* a bounded queue between a producer and a consumer: blocks are freed
+   in the order they were allocated */
+static void wl_fifo(struct run *r) {
+  size_t head = 0, tail = 0;
+
+  while(r->nlat < NOPS) {
+	if(tail - head < NSLOTS && (tail == head || next_rand(&r->seed) % 2))
+	  do_alloc(r, tail++ % NSLOTS, 16 + next_rand(&r->seed) % 241);
+	else
+	  do_free(r, head++ % NSLOTS);
+  }
+}
+
+/* every slot is filled, then half of them are freed in random order and
+   refilled, over and over */
+static void wl_random_free(struct run *r) {
+  size_t order[NSLOTS], i, j, tmp;
+
+  for(i = 0; i < NSLOTS; i++) {
+	order[i] = i;
+	do_alloc(r, i, uniform_size(&r->seed));
+  }
+  while(r->nlat + NSLOTS <= NOPS) {
+	for(i = NSLOTS - 1; i > 0; i--) {
+	  j = next_rand(&r->seed) % (i + 1);
+	  tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+	}
+	for(i = 0; i < NSLOTS / 2; i++)
+	  do_free(r, order[i]);
+	for(i = 0; i < NSLOTS / 2; i++)
+	  do_alloc(r, order[i], 16 + next_rand(&r->seed) % 1009);
+  }
+}
+
+static void *thread_main(void *arg) {
+  struct run *r = arg;
+
+  wl_uniform(r);
+  if(r->a->thread_done) r->a->thread_done();
+  return NULL;
+}
+
+struct workload {
+  const char *name;
+  void (*run)(struct run *r);
+  int threads;
+};
+
+static struct workload workloads[] = {
+  { "uniform", wl_uniform, 1 },
+  { "powerlaw", wl_powerlaw, 1 },
+  { "lifo", wl_lifo, 1 },
+  { "fifo", wl_fifo, 1 },
+  { "random-free", wl_random_free, 1 },
+  // Every thread does the same work: with perfect scaling Mops/s grows with the threads
+  { "threaded-1", wl_uniform, 1 },
+  { "threaded-2", wl_uniform, 2 },
+  { "threaded-4", wl_uniform, NTHREADS },
+};
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* run `w` with `a` and print throughput, p50/p99 latency, and the
+   share of the memory taken on during the run that is not live data
+   at its end. Each run
+   is in a child process, so every allocator starts from a fresh heap */
+static void bench_workload(struct workload *w, struct allocator *a) {
+  struct run *runs = calloc(w->threads, sizeof(struct run));
+  pthread_t tids[NTHREADS];
+  double *lat, t;
+  size_t i, k, n = 0, live = 0, held, held0;
+
+  a->setup();
+  lat = malloc(w->threads * NOPS * sizeof(double));
+  for(i = 0; i < (size_t) w->threads; i++) {
+	runs[i].a = a;
+	runs[i].lat = lat + i * NOPS;
+	runs[i].seed = 1 + i;
+  }
+  // The harness's own memory is not the allocator's
+  held0 = a->held();
+
+  t = now_ns();
+  if(w->threads == 1)
+	w->run(&runs[0]);
+  else {
+	for(i = 0; i < (size_t) w->threads; i++)
+	  pthread_create(&tids[i], NULL, thread_main, &runs[i]);
+	for(i = 0; i < (size_t) w->threads; i++)
+	  pthread_join(tids[i], NULL);
+  }
+  t = now_ns() - t;
+
+  held = a->held() - held0;
+  for(i = 0; i < (size_t) w->threads; i++) {
+	for(k = 0; k < NSLOTS; k++) {
+	  live += runs[i].sizes[k];
+	  if(runs[i].slots[k]) a->free(runs[i].slots[k]);
+	}
+	// Pack the latencies of all threads together
+	memmove(lat + n, runs[i].lat, runs[i].nlat * sizeof(double));
+	n += runs[i].nlat;
+  }
+  a->teardown();
+
+  qsort(lat, n, sizeof(double), cmp_double);
+  printf("%-12s %-11s %8.2f %8.0f %8.0f %6.3f\n", w->name, a->name, n / t * 1e3,
+		 lat[n / 2], lat[n * 99 / 100], held ? 1.0 - (double) live / held : 0);
+  free(lat);
+  free(runs);
+}
+
+int main(int argc, char *argv[]) {
+  size_t nfree, i, j;
+  const char *only = argc > 1 ? argv[1] : "";
+
+  printf("%-12s %-11s %8s %8s %8s %6s\n", "workload", "allocator", "Mops/s", "p50 ns", "p99 ns", "frag");
+  for(i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+	if(strncmp(workloads[i].name, only, strlen(only)))
+	  continue;
+	for(j = 0; j < sizeof(allocators) / sizeof(allocators[0]); j++) {
+	  fflush(stdout);
+	  if(fork() == 0) {
+		bench_workload(&workloads[i], &allocators[j]);
+		exit(0);
+	  }
+	  wait(NULL);
+	}
+  }
+  if(argc > 1)
+	return 0;
+
+  printf("\n%-12s %12s %12s\n", "free blocks", "random ns", "in order ns");
+  for(nfree = 1000; nfree <= 256000; nfree *= 4)
+	printf("%-12lu %12.1f %12.1f\n", nfree, bench_free_frag(nfree, 1), bench_free_frag(nfree, 0));
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   buddy policy
+
+   Every block is a power of two in size and sits at an offset that is a
+   multiple of its size, so the buddy of the block at `offset` is at
+   offset ^ size. The bins hold one free list per order. A pool whose
+   size is not a power of two starts out as its largest power-of-two
+   pieces in decreasing order, which keeps every piece naturally aligned
+   and stops them from ever merging with each other.
+ */
+
+#define BUDDY_MIN 16
+
+/* add [offset, offset + size) of `arena` as a free block after `prev` */
+static struct alloc_info *buddy_add(struct memory_pool *p, struct mpool_arena *arena,
+        struct alloc_info *prev, size_t offset, size_t size)
+{
+    struct alloc_info *block = block_create(p, arena, offset, size, 0);
+    if (!block) return NULL;
+
+    block->is_free = 1;
+    block->prev = prev;
+    if (prev) {
+        block->next = prev->next;
+        if (prev->next) prev->next->prev = block;
+        prev->next = block;
+    }
+    block->node = list_append(p->free_list, block);
+    free_insert(p, block);
+    return block;
+}
+
+/* carve a new arena into its initial free blocks */
+int buddy_init(struct memory_pool *p, struct mpool_arena *arena)
+{
+    struct alloc_info *last = NULL;
+    size_t offset = 0, rest = arena->size, piece;
+
+    while (rest >= BUDDY_MIN) {
+        piece = (size_t) 1 << (63 - __builtin_clzll(rest));
+        last = buddy_add(p, arena, last, offset, piece);
+        if (!last) return 0;
+        // Only memory that was committed can have been touched
+        dirty_add(p, last, 0, arena->committed);
+        offset += piece;
+        rest -= piece;
+    }
+    return 1;
+}
+
+/* find a free block of the smallest order that holds `size` bytes at
+   alignment `align`, splitting a larger one if needed */
+struct alloc_info *buddy_find(struct memory_pool *p, size_t size, size_t align)
+{
+    size_t need = size > align ? size : align;
+    unsigned order;
+    int bin;
+    struct alloc_info *block, *upper;
+
+    /* offsets are only aligned relative to the start of an arena, which
+       is only page aligned */
+    if (align > os_page_size())
+        need = size + align - 1;
+    if (need < BUDDY_MIN)
+        need = BUDDY_MIN;
+    order = 64 - __builtin_clzll(need - 1);
+
+    bin = find_bin(p, order);
+    if (bin < 0) return NULL;
+    block = p->bins[bin];
+
+    while ((unsigned) bin > order) {
+        free_remove(p, block);
+        block->size /= 2;
+        free_insert(p, block);
+        upper = buddy_add(p, block->arena, block, block->offset + block->size, block->size);
+        if (!upper) return NULL;
+        dirty_split(p, block, upper);
+        bin--;
+    }
+    return block;
+}
+
+/* merge a block being freed with its buddy for as long as the buddy is
+   free and whole; returns the resulting block, not yet on any list */
+struct alloc_info *buddy_merge(struct memory_pool *p, struct alloc_info *block)
+{
+    struct alloc_info *buddy, *lower, *upper;
+    size_t offset;
+
+    for (;;) {
+        offset = block->offset ^ block->size;
+        buddy = offset > block->offset ? block->next : block->prev;
+        if (!buddy || !buddy->is_free || buddy->offset != offset || buddy->size != block->size)
+            return block;
+
+        free_remove(p, buddy);
+        list_remove(p->free_list, buddy->node);
+
+        lower = offset > block->offset ? block : buddy;
+        upper = offset > block->offset ? buddy : block;
+        lower->size *= 2;
+        lower->next = upper->next;
+        if (upper->next) upper->next->prev = lower;
+        dirty_absorb(p, lower, upper);
+        block_release(p, upper);
+        block = lower;
+    }
+}
+
+/* resize an allocated block in place: halve it while the request fits
+   in the lower half, or absorb free upper buddies until it fits;
+   returns 0 if it has to move */
+int buddy_resize(struct memory_pool *p, struct alloc_info *block, size_t size)
+{
+    struct alloc_info *buddy;
+    size_t want = block->pad + size;
+    size_t grown = block->size;
+
+    if (want < BUDDY_MIN)
+        want = BUDDY_MIN;
+
+    /* only grow if every buddy on the way up is free and whole */
+    for (buddy = block->next; grown < want; grown *= 2, buddy = buddy->next) {
+        if (block->offset & grown)
+            return 0;
+        if (!buddy || !buddy->is_free || buddy->offset != block->offset + grown
+                || buddy->size != grown)
+            return 0;
+    }
+    if (grown > block->size &&
+            !os_commit(block->arena->start, &block->arena->committed, block->offset + grown,
+                block->arena->reserved, p->flags))
+        return 0;
+
+    while (block->size < want) {
+        buddy = block->next;
+        free_remove(p, buddy);
+        list_remove(p->free_list, buddy->node);
+        block->size *= 2;
+        block->next = buddy->next;
+        if (buddy->next) buddy->next->prev = block;
+        block_release(p, buddy);
+    }
+
+    while (block->size / 2 >= want) {
+        block->size /= 2;
+        buddy = buddy_add(p, block->arena, block, block->offset + block->size, block->size);
+        if (buddy)
+            dirty_add(p, buddy, buddy->offset, buddy->offset + buddy->size);
+    }
+    return 1;
+}
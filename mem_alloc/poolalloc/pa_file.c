@@ -0,0 +1,321 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   file-backed pools
+
+   mpool_open_file maps a pool from a file with MAP_SHARED, so that
+   everything the pool knows survives the process. The file holds
+
+       | header, with the pool in it | arena | bookkeeping heap |
+
+   and the bookkeeping the pool would otherwise map for itself (block
+   records, the tag table, the arena) comes from the heap, in power of
+   two sized pieces with a free list per size. The heap starts at
+   HEAP_MIN and the file is extended whenever it fills, up to a record
+   and its share of tag tables for every HEAP_BLOCK bytes of arena,
+   about 20 times the arena. The mapping reserves address space for
+   all of it from the start, so the heap grows without moving anything.
+
+   While the pool is open its state is linked by plain pointers like
+   that of any other pool. mpool_destroy rewrites each of them as an
+   offset from the start of the file, and mpool_open_file turns them
+   back into pointers into wherever the file is mapped this time, so a
+   file can be mapped at any address. Objects the program keeps in the
+   pool should link to each other by mpool_off for the same reason, and
+   be found again through mpool_root. Alignment beyond a page holds only
+   for the mapping an object was allocated in. A file whose pool was not
+   closed with mpool_destroy may be half updated and is refused.
+ */
+
+#define FILE_MAGIC "MPFILE03"
+#define HEAP_BLOCK 16
+#define HEAP_MIN ((size_t) 1 << 20)
+#define HEAP_CLASSES 64
+
+struct mpool_file {
+    char magic[8];
+    size_t map_size;            /* length of the mapping, with room for the heap to grow */
+    size_t heap_off;            /* where the heap starts, after the arena */
+    size_t heap_size;           /* bytes of heap in the file, which ends with it */
+    size_t heap_max;            /* bytes of heap the mapping has room for */
+    size_t heap_used;
+    void *heap_free[HEAP_CLASSES]; /* freed heap pieces of 1 << c bytes */
+    int clean;                  /* the pool was closed with mpool_destroy */
+    int fd;
+    struct memory_pool pool;
+};
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) & ~(to - 1);
+}
+
+/* smallest power of two of at least a page that holds `size` bytes */
+static unsigned heap_class(size_t size)
+{
+    if (size < os_page_size())
+        size = os_page_size();
+    return 64 - __builtin_clzll(size - 1);
+}
+
+/* extend the file so the heap holds `need` bytes, doubling it */
+static int heap_grow(struct mpool_file *f, size_t need)
+{
+    size_t size = f->heap_size;
+
+    if (need > f->heap_max) return 0;
+    while (size < need)
+        size *= 2;
+    if (size > f->heap_max)
+        size = f->heap_max;
+    if (ftruncate(f->fd, f->heap_off + size))
+        return 0;
+    f->heap_size = size;
+    return 1;
+}
+
+void *meta_map(struct memory_pool *p, size_t size)
+{
+    struct mpool_file *f = p->file;
+    unsigned c;
+    void *mem;
+
+    if (!f) return os_map(size);
+
+    c = heap_class(size);
+    if ((mem = f->heap_free[c])) {
+        f->heap_free[c] = *(void **) mem;
+        memset(mem, 0, (size_t) 1 << c);
+        return mem;
+    }
+    if (f->heap_used + ((size_t) 1 << c) > f->heap_size && !heap_grow(f, f->heap_used + ((size_t) 1 << c)))
+        return NULL;
+    // Never used before, so still zero
+    mem = (char *) f + f->heap_off + f->heap_used;
+    f->heap_used += (size_t) 1 << c;
+    return mem;
+}
+
+void meta_unmap(struct memory_pool *p, void *mem, size_t size)
+{
+    struct mpool_file *f = p->file;
+    unsigned c;
+
+    if (!f) {
+        os_unmap(mem, size);
+        return;
+    }
+    if (!mem) return;
+    c = heap_class(size);
+    *(void **) mem = f->heap_free[c];
+    f->heap_free[c] = mem;
+}
+
+/* Most heap an arena of `size` bytes can need, cut into blocks of
+   HEAP_BLOCK: a record for each, a tag table of up to four slots per
+   block and as much again in the tables it grew out of. HEAP_MIN covers
+   the arena, the partly used chunk of records and small pools. */
+static size_t heap_max(size_t size)
+{
+    size_t per_block = sizeof(struct alloc_info) + 8 * sizeof(struct mpool_tag);
+
+    return round_up(size / HEAP_BLOCK * per_block + HEAP_MIN, os_page_size());
+}
+
+/* Rewrite every address the pool keeps in the file, from relative to
+   `from` to relative to `to`, where the mapping is at `f`. File pools
+   take no mpool_opts, so there are no small runs, guard slots or
+   deferred frees to follow; the tag table is rebuilt after opening
+   instead, since its slots depend on the addresses. */
+static void file_rebase(struct mpool_file *f, uintptr_t from, uintptr_t to)
+{
+    struct rebase r = { (uintptr_t) f, from, to };
+    struct memory_pool *p = &f->pool;
+    struct mpool_arena *arena, *next_arena;
+    void **piece, *next;
+    unsigned c, i;
+
+    for (c = 0; c < HEAP_CLASSES; c++) {
+        piece = rebase_at(&r, f->heap_free[c]);
+        f->heap_free[c] = rebase_ptr(&r, f->heap_free[c]);
+        for (; piece; piece = next) {
+            next = rebase_at(&r, *piece);
+            *piece = rebase_ptr(&r, *piece);
+        }
+    }
+
+    for (arena = rebase_at(&r, p->arenas); arena; arena = next_arena) {
+        next_arena = rebase_at(&r, arena->next);
+        arena->start = rebase_ptr(&r, arena->start);
+        arena->next = rebase_ptr(&r, arena->next);
+    }
+    meta_rebase(p, &r);
+
+    p->start = rebase_ptr(&r, p->start);
+    p->arenas = rebase_ptr(&r, p->arenas);
+    p->alloc_list = rebase_ptr(&r, p->alloc_list);
+    p->free_list = rebase_ptr(&r, p->free_list);
+    p->alloc_head.first = rebase_ptr(&r, p->alloc_head.first);
+    p->alloc_head.last = rebase_ptr(&r, p->alloc_head.last);
+    p->free_head.first = rebase_ptr(&r, p->free_head.first);
+    p->free_head.last = rebase_ptr(&r, p->free_head.last);
+    for (i = 0; i < MPOOL_NBINS; i++)
+        p->bins[i] = rebase_ptr(&r, p->bins[i]);
+    p->tree = rebase_ptr(&r, p->tree);
+    p->tags = rebase_ptr(&r, p->tags);
+    p->bump_arena = rebase_ptr(&r, p->bump_arena);
+    p->last = rebase_ptr(&r, p->last);
+    p->dirty_first = rebase_ptr(&r, p->dirty_first);
+    p->dirty_last = rebase_ptr(&r, p->dirty_last);
+    p->file = NULL;
+}
+
+/* lay out a new file of `size` pool bytes in the mapping at `f` */
+static struct memory_pool *file_create(struct mpool_file *f, size_t header, size_t size)
+{
+    struct memory_pool *p = &f->pool;
+    struct mpool_arena *arena;
+
+    memcpy(f->magic, FILE_MAGIC, 8);
+    f->heap_off = header + size;
+    f->heap_size = HEAP_MIN;
+    f->heap_max = f->map_size - f->heap_off;
+
+    p->file = f;
+    p->alloc_list = &p->alloc_head;
+    p->free_list = &p->free_head;
+    arena = meta_map(p, sizeof(struct mpool_arena));
+    if (!arena) return NULL;
+    arena->start = (char *) f + header;
+    arena->size = arena->reserved = arena->committed = size;
+    if (!arena_link(p, arena)) return NULL;
+    p->start = arena->start;
+    p->size = size;
+    p->bump_arena = arena;
+    return p;
+}
+
+/* Open the pool kept in the file at `path`, creating the file with a
+   pool of `size` bytes if it does not exist. The size of an existing
+   pool is the one it was created with. The file holds the arena and the
+   bookkeeping in use; the address space mapped is about 20 times the
+   arena, to leave the bookkeeping room to grow. Close the pool with mpool_destroy, which
+   leaves it in the file. Returns NULL, after printing why, if the file
+   cannot be used */
+struct memory_pool *mpool_open_file(const char *path, size_t size)
+{
+    struct mpool_file head, *f;
+    struct memory_pool *p;
+    size_t header = round_up(sizeof(struct mpool_file), os_page_size());
+    size_t len;
+    struct stat st;
+    int fd, fresh;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || fstat(fd, &st)) {
+        POOL_ERROR("ERROR: cannot open %s\n", path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    fresh = st.st_size == 0;
+    if (fresh) {
+        size = round_up(size ? size : 1, os_page_size());
+        len = header + size + heap_max(size);
+        if (ftruncate(fd, header + size + HEAP_MIN)) {
+            POOL_ERROR("ERROR: cannot size %s to %lu bytes\n", path, header + size + HEAP_MIN);
+            close(fd);
+            return NULL;
+        }
+        f = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    else {
+        if (pread(fd, &head, sizeof(head), 0) != sizeof(head) || memcmp(head.magic, FILE_MAGIC, 8) ||
+            head.heap_off + head.heap_size != (size_t) st.st_size) {
+            POOL_ERROR("ERROR: %s does not hold a pool\n", path);
+            close(fd);
+            return NULL;
+        }
+        if (!head.clean) {
+            POOL_ERROR("ERROR: the pool in %s was not closed cleanly\n", path);
+            close(fd);
+            return NULL;
+        }
+        len = head.map_size;
+        f = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (f == MAP_FAILED) {
+        POOL_ERROR("ERROR: cannot map %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    f->map_size = len;
+    f->fd = fd;
+    if (fresh && !file_create(f, header, size)) {
+        POOL_ERROR("ERROR: cannot lay out a pool in %s\n", path);
+        munmap(f, len);
+        close(fd);
+        return NULL;
+    }
+    p = &f->pool;
+    if (!fresh) {
+        file_rebase(f, 0, (uintptr_t) f);
+        p->file = f;
+        tag_rebuild(p);
+    }
+
+    // Nothing that belongs to the process that closed the pool is valid
+    p->flags &= ~MPOOL_GUARD;
+    p->guard = NULL;
+    p->trace = NULL;
+    p->maint_on = 0;
+    pthread_mutex_init(&p->lock, NULL);
+
+    // Until mpool_destroy, a crash leaves the file marked as in use
+    f->clean = 0;
+    msync(f, header, MS_SYNC);
+    return p;
+}
+
+/* write a file-backed pool out and unmap it; for mpool_destroy */
+void file_close(struct memory_pool *p)
+{
+    struct mpool_file *f = p->file;
+    int fd = f->fd;
+
+    pthread_mutex_destroy(&p->lock);
+    file_rebase(f, (uintptr_t) f, 0);
+    msync(f, f->heap_off + f->heap_size, MS_SYNC);
+    f->clean = 1;
+    msync(f, round_up(sizeof(*f), os_page_size()), MS_SYNC);
+    munmap(f, f->map_size);
+    close(fd);
+}
+
+/* name the object the program finds its data through when it reopens
+   a file-backed pool */
+void mpool_set_root(struct memory_pool *p, void *obj)
+{
+    pthread_mutex_lock(&p->lock);
+    p->root = mpool_off(p, obj);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void *mpool_root(struct memory_pool *p)
+{
+    void *obj;
+
+    pthread_mutex_lock(&p->lock);
+    obj = mpool_ptr(p, p->root);
+    pthread_mutex_unlock(&p->lock);
+    return obj;
+}
@@ -0,0 +1,328 @@
+#define _POSIX_C_SOURCE 200809L
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   sampled guarded allocations
+
+   Under MPOOL_GUARD about one in `rate` allocations of up to a page is
+   served from a guard area instead of the pool. The area is one
+   reservation of MPOOL_GUARD_SLOTS pages with an inaccessible page on
+   each side of every one of them:
+
+       | guard | slot 0 | guard | slot 1 | ... | slot N-1 | guard |
+
+   A block is placed at the end of its slot, so running off the end
+   faults on the next guard page; the few bytes between the block and
+   the page end that its alignment leaves are filled with a pattern and
+   checked when it is freed. A freed slot loses all access and goes to
+   the back of the queue of free slots, so the freed block stays
+   unreachable for as long as possible and a use-after-free faults.
+
+   Faults in a guard area are caught by a SIGSEGV handler, which reports
+   the block and the call sites that allocated and freed it, then lets
+   the fault happen again under the handler that was installed before.
+   Unsampled calls cost one decrement on allocation and one range check
+   on free. A sampled block costs two mprotect calls, which at the
+   default rate of MPOOL_GUARD_RATE is a fraction of a percent, so the
+   mode can stay on in production. Freed slots keep their pages, so the
+   area holds at most MPOOL_GUARD_SLOTS pages of memory.
+ */
+
+#define GUARD_POOLS 64
+#define SLACK_BYTE 0xab
+
+enum slot_state { SLOT_UNUSED, SLOT_LIVE, SLOT_FREED };
+
+struct guard_slot {
+    char *addr;                 /* the block */
+    size_t size;
+    void *alloc_site, *free_site;
+    enum slot_state state;
+};
+
+struct mpool_guard {
+    char *area;
+    size_t reserved;
+    size_t page;
+    unsigned rate;
+    uint64_t seed;              /* for the distance to the next sample */
+    unsigned head, count;       /* free slots, oldest first */
+    unsigned queue[MPOOL_GUARD_SLOTS];
+    struct guard_slot slots[MPOOL_GUARD_SLOTS];
+};
+
+/* guard areas of every pool, for the signal handler */
+static struct mpool_guard *volatile guards[GUARD_POOLS];
+static pthread_mutex_t guards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction old_segv;
+static int handler_on;
+
+static char *slot_page(struct mpool_guard *g, unsigned i)
+{
+    return g->area + (2 * (size_t) i + 1) * g->page;
+}
+
+/* the next distance between samples, `rate` on average */
+static unsigned next_sample(struct mpool_guard *g)
+{
+    g->seed ^= g->seed << 13;
+    g->seed ^= g->seed >> 7;
+    g->seed ^= g->seed << 17;
+    return 1 + g->seed % (2 * g->rate - 1);
+}
+
+/* async-signal-safe output for the handler */
+static void put(const char *s)
+{
+    ssize_t n = write(STDERR_FILENO, s, strlen(s));
+    (void) n;
+}
+
+static void put_num(uintptr_t n, int hex)
+{
+    char buf[24], *end = buf + sizeof(buf) - 1, *s = end;
+
+    *end = 0;
+    do *--s = "0123456789abcdef"[n % (hex ? 16 : 10)];
+    while ((n /= hex ? 16 : 10));
+    if (hex) put("0x");
+    put(s);
+}
+
+static void report(const char *what, struct guard_slot *slot, char *fault)
+{
+    put("ERROR: ");
+    put(what);
+    put(" of ");
+    put_num(slot->size, 0);
+    put("-byte guarded block ");
+    put_num((uintptr_t) slot->addr, 1);
+    put(" at ");
+    put_num((uintptr_t) fault, 1);
+    put("\n    allocated from ");
+    put_num((uintptr_t) slot->alloc_site, 1);
+    if (slot->state == SLOT_FREED) {
+        put("\n    freed from ");
+        put_num((uintptr_t) slot->free_site, 1);
+    }
+    put("\n");
+}
+
+/* explain a fault at `fault` in the area of g */
+static void explain(struct mpool_guard *g, char *fault)
+{
+    size_t page = (fault - g->area) / g->page;
+    struct guard_slot *slot;
+
+    if (page % 2) {
+        slot = &g->slots[page / 2];
+        if (slot->state == SLOT_FREED)
+            report("use-after-free", slot, fault);
+        else
+            put("ERROR: access to an unused guarded slot\n");
+        return;
+    }
+    // A guard page: blocks end at their page end, so blame the slot before it
+    if (page) {
+        slot = &g->slots[page / 2 - 1];
+        report(slot->state == SLOT_FREED ? "use-after-free overflow" : "overflow", slot, fault);
+    }
+    else if (g->slots[0].state != SLOT_UNUSED)
+        report("underflow", &g->slots[0], fault);
+}
+
+static void on_segv(int sig, siginfo_t *info, void *ctx)
+{
+    char *fault = info->si_addr;
+    struct mpool_guard *g;
+    unsigned i;
+
+    for (i = 0; i < GUARD_POOLS; i++) {
+        g = guards[i];
+        if (g && fault >= g->area && fault < g->area + g->reserved) {
+            explain(g, fault);
+            break;
+        }
+    }
+
+    // Let the fault repeat under the previous handler, or chain to it
+    if (i == GUARD_POOLS && (old_segv.sa_flags & SA_SIGINFO))
+        old_segv.sa_sigaction(sig, info, ctx);
+    else if (i == GUARD_POOLS && old_segv.sa_handler != SIG_DFL && old_segv.sa_handler != SIG_IGN)
+        old_segv.sa_handler(sig);
+    else
+        sigaction(SIGSEGV, &old_segv, NULL);
+}
+
+static int guard_register(struct mpool_guard *g)
+{
+    struct sigaction sa;
+    unsigned i;
+
+    pthread_mutex_lock(&guards_lock);
+    for (i = 0; i < GUARD_POOLS && guards[i]; i++)
+        ;
+    if (i < GUARD_POOLS) {
+        guards[i] = g;
+        if (!handler_on) {
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = on_segv;
+            sa.sa_flags = SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            handler_on = !sigaction(SIGSEGV, &sa, &old_segv);
+        }
+    }
+    pthread_mutex_unlock(&guards_lock);
+    return i < GUARD_POOLS;
+}
+
+static void guard_unregister(struct mpool_guard *g)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&guards_lock);
+    for (i = 0; i < GUARD_POOLS; i++)
+        if (guards[i] == g) guards[i] = NULL;
+    pthread_mutex_unlock(&guards_lock);
+}
+
+/* set up the guard area of a MPOOL_GUARD pool; returns 0 on failure */
+int guard_init(struct memory_pool *p, unsigned rate)
+{
+    struct mpool_guard *g = os_map(sizeof(struct mpool_guard));
+
+    if (!g) return 0;
+    g->page = os_page_size();
+    g->area = os_reserve((2 * MPOOL_GUARD_SLOTS + 1) * g->page, 0, &g->reserved);
+    if (!g->area) {
+        os_unmap(g, sizeof(struct mpool_guard));
+        return 0;
+    }
+    g->rate = rate ? rate : MPOOL_GUARD_RATE;
+    g->seed = (uintptr_t) g->area | 1;
+    p->guard = g;
+    guard_reset(p);
+    if (!guard_register(g)) {
+        guard_close(p);
+        return 0;
+    }
+    return 1;
+}
+
+/* forget every guarded block and make all slots free again */
+void guard_reset(struct memory_pool *p)
+{
+    struct mpool_guard *g = p->guard;
+    unsigned i;
+
+    for (i = 0; i < MPOOL_GUARD_SLOTS; i++) {
+        if (g->slots[i].state == SLOT_LIVE)
+            os_protect(slot_page(g, i), g->page, 0);
+        g->slots[i].state = SLOT_UNUSED;
+        g->queue[i] = i;
+    }
+    g->head = 0;
+    g->count = MPOOL_GUARD_SLOTS;
+    p->guard_left = next_sample(g);
+}
+
+void guard_close(struct memory_pool *p)
+{
+    struct mpool_guard *g = p->guard;
+
+    guard_unregister(g);
+    os_release(g->area, g->reserved);
+    os_unmap(g, sizeof(struct mpool_guard));
+    p->guard = NULL;
+}
+
+/* serve a sampled allocation from a guarded slot; NULL if it does not
+   fit in a page or every slot is in use, to fall back to the pool */
+void *guard_alloc(struct memory_pool *p, size_t size, size_t align, void *site)
+{
+    struct mpool_guard *g = p->guard;
+    struct guard_slot *slot;
+    unsigned i;
+    char *page;
+
+    p->guard_left = next_sample(g);
+    if (size > g->page || align > g->page || !g->count)
+        return NULL;
+
+    i = g->queue[g->head];
+    page = slot_page(g, i);
+    if (!os_protect(page, g->page, 1))
+        return NULL;
+    g->head = (g->head + 1) % MPOOL_GUARD_SLOTS;
+    g->count--;
+
+    slot = &g->slots[i];
+    slot->addr = page + ((g->page - size) & ~(align - 1));
+    slot->size = size;
+    slot->alloc_site = site;
+    slot->free_site = NULL;
+    slot->state = SLOT_LIVE;
+    memset(slot->addr + size, SLACK_BYTE, page + g->page - slot->addr - size);
+    stat_alloc(p, size, size);
+    return slot->addr;
+}
+
+/* the slot holding `addr`, or NULL if it is not in the guard area */
+static struct guard_slot *find_slot(struct mpool_guard *g, void *addr)
+{
+    size_t page;
+
+    if ((char *) addr < g->area || (char *) addr >= g->area + g->reserved)
+        return NULL;
+    page = ((char *) addr - g->area) / g->page;
+    return page % 2 ? &g->slots[page / 2] : NULL;
+}
+
+/* free `addr` if it is a guarded block; returns 0 if it is not in the
+   guard area at all */
+int guard_free(struct memory_pool *p, void *addr, void *site)
+{
+    struct mpool_guard *g = p->guard;
+    struct guard_slot *slot;
+    unsigned char *c, *end;
+
+    if ((char *) addr < g->area || (char *) addr >= g->area + g->reserved)
+        return 0;
+    slot = find_slot(g, addr);
+    if (!slot || slot->addr != addr || slot->state != SLOT_LIVE) {
+        if (slot && slot->addr == addr && slot->state == SLOT_FREED)
+            POOL_ERROR("ERROR: double free of guarded block %p (first freed from %p)\n", addr, slot->free_site);
+        else
+            POOL_ERROR("ERROR: cannot free unallocated address\n");
+        return 1;
+    }
+
+    end = (unsigned char *) slot_page(g, slot - g->slots) + g->page;
+    for (c = (unsigned char *) slot->addr + slot->size; c < end; c++) {
+        if (*c != SLACK_BYTE) {
+            POOL_ERROR("ERROR: overflow of %lu-byte guarded block %p found on free (allocated from %p)\n",
+                       slot->size, addr, slot->alloc_site);
+            break;
+        }
+    }
+
+    os_protect(slot_page(g, slot - g->slots), g->page, 0);
+    slot->free_site = site;
+    slot->state = SLOT_FREED;
+    g->queue[(g->head + g->count++) % MPOOL_GUARD_SLOTS] = slot - g->slots;
+    stat_free(p, slot->size);
+    return 1;
+}
+
+/* size of the guarded block at `addr`, or 0 if there is none */
+size_t guard_size(struct memory_pool *p, void *addr)
+{
+    struct guard_slot *slot = find_slot(p->guard, addr);
+
+    return slot && slot->addr == addr && slot->state == SLOT_LIVE ? slot->size : 0;
+}
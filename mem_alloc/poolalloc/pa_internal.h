@@ -0,0 +1,144 @@
+#pragma once
+#include "poolalloc.h"
+
+/* pool internals shared by the allocator's source files */
+/* unless noted otherwise the caller must hold p->lock */
+
+/* errors are reported on stdout, except in libpoolalloc.so (built with
+   MPOOL_PRELOAD), where stdout belongs to the program it serves */
+#ifdef MPOOL_PRELOAD
+#define POOL_ERROR(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define POOL_ERROR(...) printf(__VA_ARGS__)
+#endif
+
+size_t calc_align(size_t size);
+size_t align_address(size_t align, size_t offset);
+void *pool_alloc(struct memory_pool *p, size_t size, size_t align);
+void pool_free(struct memory_pool *p, void *addr);
+struct alloc_info *pool_find(struct memory_pool *p, void *addr);
+size_t pool_coalesce(struct memory_pool *p, size_t max);
+size_t pool_purge(struct memory_pool *p, unsigned long idle_ms, size_t max);
+struct mpool_arena *arena_link(struct memory_pool *p, struct mpool_arena *arena);
+
+/* dirty free blocks, for decay (pa_maint.c) */
+void dirty_add(struct memory_pool *p, struct alloc_info *block, size_t lo, size_t hi);
+void dirty_absorb(struct memory_pool *p, struct alloc_info *block, struct alloc_info *from);
+void dirty_split(struct memory_pool *p, struct alloc_info *block, struct alloc_info *rest);
+void dirty_remove(struct memory_pool *p, struct alloc_info *block);
+
+/* block records and their list nodes (pa_meta.c) */
+struct alloc_info *block_create(struct memory_pool *p, struct mpool_arena *arena,
+                                size_t offset, size_t size, size_t req_size);
+void block_release(struct memory_pool *p, struct alloc_info *block);
+void meta_release_all(struct memory_pool *p);
+
+/* moving a file-backed pool between mappings (pa_file.c): a stored
+   address v, taken relative to `from`, lies at map + (v - from) and is
+   rewritten relative to `to`; NULL stays NULL */
+struct rebase {
+    uintptr_t map, from, to;
+};
+
+static inline void *rebase_at(const struct rebase *r, const void *v)
+{
+    return v ? (void *) ((uintptr_t) v - r->from + r->map) : NULL;
+}
+
+static inline void *rebase_ptr(const struct rebase *r, const void *v)
+{
+    return v ? (void *) ((uintptr_t) v - r->from + r->to) : NULL;
+}
+
+void meta_rebase(struct memory_pool *p, const struct rebase *r);
+void tag_rebuild(struct memory_pool *p);
+
+/* memory for the pool's own bookkeeping: mapped from the system, or
+   from the pool's file when it has one (pa_file.c) */
+void *meta_map(struct memory_pool *p, size_t size);
+void meta_unmap(struct memory_pool *p, void *mem, size_t size);
+void file_close(struct memory_pool *p);
+struct llnode *list_append(struct dbll *list, struct alloc_info *block);
+void list_remove(struct dbll *list, struct llnode *node);
+
+/* counters behind mpool_stats (pa_stats.c) */
+static inline unsigned stat_class(size_t size)
+{
+    unsigned c = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+
+    return c < MPOOL_STAT_CLASSES ? c : MPOOL_STAT_CLASSES - 1;
+}
+
+static inline void stat_alloc(struct memory_pool *p, size_t size, size_t used)
+{
+    p->in_use += used;
+    if (p->in_use > p->high_water)
+        p->high_water = p->in_use;
+    p->nalloc++;
+    p->size_hist[stat_class(size)]++;
+}
+
+static inline void stat_free(struct memory_pool *p, size_t used)
+{
+    p->in_use -= used;
+    p->nfree++;
+}
+
+/* allocation tracing (pa_trace.c), called only while p->trace is set */
+void trace_alloc(struct memory_pool *p, void *addr, size_t size);
+void trace_free(struct memory_pool *p, void *addr);
+void trace_realloc(struct memory_pool *p, void *addr, void *moved, size_t size);
+void trace_close(struct mpool_trace *t);
+void trace_discard(struct mpool_trace *t);
+
+/* small blocks (pa_small.c) */
+void *small_alloc(struct memory_pool *p, size_t size);
+int small_free(struct memory_pool *p, void *addr);
+size_t small_size(struct memory_pool *p, void *addr);
+
+/* sampled guarded allocations (pa_guard.c) */
+int guard_init(struct memory_pool *p, unsigned rate);
+void guard_reset(struct memory_pool *p);
+void guard_close(struct memory_pool *p);
+void *guard_alloc(struct memory_pool *p, size_t size, size_t align, void *site);
+int guard_free(struct memory_pool *p, void *addr, void *site);
+size_t guard_size(struct memory_pool *p, void *addr);
+
+/* whether MPOOL_GUARD picks this allocation to be guarded */
+static inline int guard_sample(struct memory_pool *p)
+{
+    return (p->flags & MPOOL_GUARD) && !--p->guard_left;
+}
+
+/* address of the start of `block` */
+static inline uintptr_t block_addr(struct alloc_info *block)
+{
+    return (uintptr_t) (block->arena->start + block->offset);
+}
+
+/* free-block index of the pool's policy */
+int find_bin(struct memory_pool *p, unsigned c);
+void free_insert(struct memory_pool *p, struct alloc_info *block);
+void free_remove(struct memory_pool *p, struct alloc_info *block);
+
+/* best-fit tree (pa_tree.c); functions return the new root */
+struct alloc_info *tree_insert(struct alloc_info *t, struct alloc_info *block);
+struct alloc_info *tree_remove(struct alloc_info *t, struct alloc_info *block);
+struct alloc_info *tree_lower_bound(struct alloc_info *t, size_t size, uintptr_t addr);
+
+/* buddy policy (pa_buddy.c) */
+int buddy_init(struct memory_pool *p, struct mpool_arena *arena);
+struct alloc_info *buddy_find(struct memory_pool *p, size_t size, size_t align);
+struct alloc_info *buddy_merge(struct memory_pool *p, struct alloc_info *block);
+int buddy_resize(struct memory_pool *p, struct alloc_info *block, size_t size);
+
+/* system memory (pa_os.c) */
+size_t os_page_size(void);
+char *os_reserve(size_t size, unsigned flags, size_t *reserved);
+int os_commit(char *start, size_t *committed, size_t end, size_t reserved, unsigned flags);
+int os_protect(char *start, size_t len, int access);
+size_t os_purge_unit(unsigned flags);
+size_t os_purge(char *start, size_t len, unsigned flags);
+void os_release(char *start, size_t reserved);
+void *os_map(size_t size);
+void os_unmap(void *mem, size_t size);
@@ -0,0 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   background maintenance
+
+   A maintenance thread wakes every interval and merges the frees an
+   MPOOL_DEFER pool has queued, MAINT_BATCH at a time so the lock is
+   never held for long and allocating threads get in between batches.
+
+   It also advances the pool clock by the interval on every pass. A free
+   block is stamped with the clock whenever it takes freed memory, and
+   remembers the range of its arena that may hold pages touched since
+   they were last given back. Blocks with a dirty range of at least a
+   page wait on a queue, oldest stamp first. With a decay time set, each
+   pass takes the blocks that have been idle that long off the front of
+   the queue, again MAINT_BATCH at a time, and hands their dirty pages
+   back to the system. They stay mapped and come back as zero pages when
+   an allocation touches them, so nothing has to be recommitted by hand.
+ */
+
+#define MAINT_BATCH 256
+
+/* narrow the dirty range of `block` to the block itself */
+static void dirty_clip(struct alloc_info *block)
+{
+    if (block->dirty_lo < block->offset)
+        block->dirty_lo = block->offset;
+    if (block->dirty_hi > block->offset + block->size)
+        block->dirty_hi = block->offset + block->size;
+    if (block->dirty_hi <= block->dirty_lo)
+        block->dirty_lo = block->dirty_hi = 0;
+}
+
+/* put `block` on the queue after `pos`, or at the back if pos is NULL */
+static void dirty_insert(struct memory_pool *p, struct alloc_info *block, struct alloc_info *pos)
+{
+    if (!pos) pos = p->dirty_last;
+    block->dirty_prev = pos;
+    block->dirty_next = pos ? pos->dirty_next : NULL;
+    if (block->dirty_next)
+        block->dirty_next->dirty_prev = block;
+    else
+        p->dirty_last = block;
+    if (pos)
+        pos->dirty_next = block;
+    else
+        p->dirty_first = block;
+}
+
+/* take `block` off the queue, if it is on it */
+void dirty_remove(struct memory_pool *p, struct alloc_info *block)
+{
+    if (!block->dirty_prev && p->dirty_first != block)
+        return;
+    if (block->dirty_prev)
+        block->dirty_prev->dirty_next = block->dirty_next;
+    else
+        p->dirty_first = block->dirty_next;
+    if (block->dirty_next)
+        block->dirty_next->dirty_prev = block->dirty_prev;
+    else
+        p->dirty_last = block->dirty_prev;
+    block->dirty_prev = block->dirty_next = NULL;
+}
+
+/* the free `block` takes freed memory, of which [lo, hi) of its arena
+   may be dirty: stamp it and move it to the back of the queue */
+void dirty_add(struct memory_pool *p, struct alloc_info *block, size_t lo, size_t hi)
+{
+    dirty_clip(block);
+    if (lo < hi && block->dirty_lo < block->dirty_hi) {
+        if (lo > block->dirty_lo) lo = block->dirty_lo;
+        if (hi < block->dirty_hi) hi = block->dirty_hi;
+    }
+    if (lo < hi) {
+        block->dirty_lo = lo;
+        block->dirty_hi = hi;
+        dirty_clip(block);
+    }
+    block->freed_at = p->clock;
+
+    dirty_remove(p, block);
+    if (block->dirty_lo < block->dirty_hi && block->size >= os_purge_unit(p->flags))
+        dirty_insert(p, block, NULL);
+}
+
+/* the free `block` has grown over the free block `from` */
+void dirty_absorb(struct memory_pool *p, struct alloc_info *block, struct alloc_info *from)
+{
+    dirty_clip(from);
+    dirty_add(p, block, from->dirty_lo, from->dirty_hi);
+}
+
+/* `rest` was split off the free `block` and keeps its state */
+void dirty_split(struct memory_pool *p, struct alloc_info *block, struct alloc_info *rest)
+{
+    rest->dirty_lo = block->dirty_lo;
+    rest->dirty_hi = block->dirty_hi;
+    rest->freed_at = block->freed_at;
+    dirty_clip(rest);
+    if (rest->dirty_lo < rest->dirty_hi && (block->dirty_prev || p->dirty_first == block))
+        dirty_insert(p, rest, block);
+}
+
+/* release the dirty pages of up to `max` free blocks idle for at least
+   `idle_ms`, oldest first; returns the number of bytes released */
+size_t pool_purge(struct memory_pool *p, unsigned long idle_ms, size_t max)
+{
+    size_t unit = os_purge_unit(p->flags);
+    struct alloc_info *block;
+    struct mpool_arena *arena;
+    uintptr_t from, to;
+    size_t hi, bytes = 0;
+
+    for (; (block = p->dirty_first) && max && p->clock - block->freed_at >= idle_ms; max--) {
+        arena = block->arena;
+        dirty_clip(block);
+        // Past the committed end there is nothing to give back
+        hi = block->dirty_hi < arena->committed ? block->dirty_hi : arena->committed;
+        if (hi > block->dirty_lo) {
+            // Every page the range touches, as far as it lies inside the block
+            from = ((uintptr_t) arena->start + block->dirty_lo) & ~(unit - 1);
+            to = ((uintptr_t) arena->start + hi + unit - 1) & ~(unit - 1);
+            if (from < block_addr(block))
+                from = block_addr(block);
+            if (to > block_addr(block) + block->size)
+                to = block_addr(block) + block->size;
+            bytes += os_purge((char *) from, to - from, p->flags);
+        }
+        block->dirty_lo = block->dirty_hi = 0;
+        dirty_remove(p, block);
+    }
+    p->purged += bytes;
+    return bytes;
+}
+
+/* whether the oldest dirty block has been idle for decay_ms */
+static int purge_due(struct memory_pool *p)
+{
+    return p->dirty_first && p->clock - p->dirty_first->freed_at >= p->decay_ms;
+}
+
+/* hand every dirty free page of the pool back to the system now;
+   returns the number of bytes released */
+size_t mpool_purge(struct memory_pool *p)
+{
+    size_t bytes;
+
+    pthread_mutex_lock(&p->lock);
+    bytes = pool_purge(p, 0, (size_t) -1);
+    pthread_mutex_unlock(&p->lock);
+    return bytes;
+}
+
+static void *maint_main(void *arg)
+{
+    struct memory_pool *p = arg;
+    struct timespec until;
+    size_t left;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->maint_on) {
+        p->clock += p->maint_ms;
+        while (p->decay_ms && purge_due(p) && p->maint_on) {
+            pool_purge(p, p->decay_ms, MAINT_BATCH);
+            pthread_mutex_unlock(&p->lock);
+            pthread_mutex_lock(&p->lock);
+        }
+        do {
+            left = pool_coalesce(p, MAINT_BATCH);
+            pthread_mutex_unlock(&p->lock);
+            pthread_mutex_lock(&p->lock);
+        } while (left && p->maint_on);
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += p->maint_ms / 1000;
+        until.tv_nsec += (long) (p->maint_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        if (p->maint_on)
+            pthread_cond_timedwait(&p->maint_cond, &p->lock, &until);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* start a thread that does the pool's deferred work every `interval_ms`
+   milliseconds; returns 0 if it is already running or cannot start */
+int mpool_maintain_start(struct memory_pool *p, unsigned interval_ms)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (!p->maint_on) {
+        pthread_cond_init(&p->maint_cond, NULL);
+        p->maint_ms = interval_ms ? interval_ms : 1;
+        p->maint_on = 1;
+        ok = !pthread_create(&p->maint, NULL, maint_main, p);
+        if (!ok) {
+            p->maint_on = 0;
+            pthread_cond_destroy(&p->maint_cond);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ok;
+}
+
+void mpool_maintain_stop(struct memory_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    if (!p->maint_on) {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    p->maint_on = 0;
+    pthread_cond_signal(&p->maint_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(p->maint, NULL);
+    pthread_cond_destroy(&p->maint_cond);
+}
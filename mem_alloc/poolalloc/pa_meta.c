@@ -0,0 +1,138 @@
+#include <stddef.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   block metadata
+
+   Block records come from chunks the pool maps for itself, and each
+   record carries the llnode that puts it on alloc_list or free_list.
+   Released records go on a free list threaded through bin_next, so
+   allocating and freeing blocks never calls into the system heap.
+ */
+
+#define META_CHUNK ((size_t) 64 << 10)
+
+/* chunks are chained through their first word; records follow it */
+struct meta_chunk {
+    struct meta_chunk *next;
+    struct alloc_info records[];
+};
+
+#define META_RECORDS ((META_CHUNK - offsetof(struct meta_chunk, records)) / sizeof(struct alloc_info))
+
+static int meta_refill(struct memory_pool *p)
+{
+    struct meta_chunk *chunk = meta_map(p, META_CHUNK);
+    size_t i;
+
+    if (!chunk) return 0;
+    chunk->next = p->meta_chunks;
+    p->meta_chunks = chunk;
+    for (i = META_RECORDS; i-- > 0; ) {
+        chunk->records[i].bin_next = p->meta_free;
+        p->meta_free = &chunk->records[i];
+    }
+    return 1;
+}
+
+struct alloc_info *block_create(struct memory_pool *p, struct mpool_arena *arena,
+                                size_t offset, size_t size, size_t req_size)
+{
+    struct alloc_info *block;
+
+    if (!p->meta_free && !meta_refill(p))
+        return NULL;
+    block = p->meta_free;
+    p->meta_free = block->bin_next;
+
+    *block = (struct alloc_info) { 0 };
+    block->arena = arena;
+    block->offset = offset;
+    block->size = size;
+    block->request_size = req_size;
+
+    return block;
+}
+
+void block_release(struct memory_pool *p, struct alloc_info *block)
+{
+    dirty_remove(p, block);
+    block->bin_next = p->meta_free;
+    p->meta_free = block;
+}
+
+/* drop every record at once, for mpool_reset and mpool_destroy */
+void meta_release_all(struct memory_pool *p)
+{
+    struct meta_chunk *chunk, *next;
+
+    for (chunk = p->meta_chunks; chunk; chunk = next) {
+        next = chunk->next;
+        meta_unmap(p, chunk, META_CHUNK);
+    }
+    p->meta_chunks = NULL;
+    p->meta_free = NULL;
+}
+
+/* rewrite the chunk chain and every link in every record, for moving
+   a file-backed pool between mappings */
+void meta_rebase(struct memory_pool *p, const struct rebase *r)
+{
+    struct meta_chunk *chunk, *next;
+    struct alloc_info *b;
+    size_t i;
+
+    chunk = rebase_at(r, p->meta_chunks);
+    p->meta_chunks = rebase_ptr(r, p->meta_chunks);
+    p->meta_free = rebase_ptr(r, p->meta_free);
+    for (; chunk; chunk = next) {
+        next = rebase_at(r, chunk->next);
+        chunk->next = rebase_ptr(r, chunk->next);
+        for (i = 0; i < META_RECORDS; i++) {
+            b = &chunk->records[i];
+            b->dirty_prev = rebase_ptr(r, b->dirty_prev);
+            b->dirty_next = rebase_ptr(r, b->dirty_next);
+            b->arena = rebase_ptr(r, b->arena);
+            b->node = rebase_ptr(r, b->node);
+            b->link.user_data = rebase_ptr(r, b->link.user_data);
+            b->link.next = rebase_ptr(r, b->link.next);
+            b->link.prev = rebase_ptr(r, b->link.prev);
+            b->prev = rebase_ptr(r, b->prev);
+            b->next = rebase_ptr(r, b->next);
+            b->bin_prev = rebase_ptr(r, b->bin_prev);
+            b->bin_next = rebase_ptr(r, b->bin_next);
+            b->left = rebase_ptr(r, b->left);
+            b->right = rebase_ptr(r, b->right);
+        }
+    }
+}
+
+/* dbll_append and dbll_remove with the node embedded in the block */
+struct llnode *list_append(struct dbll *list, struct alloc_info *block)
+{
+    struct llnode *node = &block->link;
+
+    node->user_data = block;
+    node->next = NULL;
+    node->prev = list->last;
+    if (list->last)
+        list->last->next = node;
+    else
+        list->first = node;
+    list->last = node;
+    return node;
+}
+
+void list_remove(struct dbll *list, struct llnode *node)
+{
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        list->first = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        list->last = node->prev;
+}
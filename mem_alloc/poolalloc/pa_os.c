@@ -0,0 +1,135 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   address space for pools
+
+   A pool's region is reserved with PROT_NONE and no swap reservation,
+   then committed (made readable and writable) in chunks as allocations
+   reach further into it, so a large pool costs neither time nor RSS
+   until it is used.
+ */
+
+#define HUGE_PAGE ((size_t) 2 << 20)
+#define COMMIT_CHUNK ((size_t) 64 << 10)
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) & ~(to - 1);
+}
+
+size_t os_page_size(void)
+{
+    static size_t page;
+
+    if (!page)
+        page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+/* reserve at least `size` bytes; the reserved length goes to *reserved */
+char *os_reserve(size_t size, unsigned flags, size_t *reserved)
+{
+    char *start, *aligned;
+    size_t len;
+
+    if (flags & MPOOL_HUGE_EXPLICIT) {
+        /* hugetlbfs pages are reserved here, not on first touch: without
+           the reservation a fault can find none left and raise SIGBUS */
+        len = round_up(size, HUGE_PAGE);
+        start = mmap(NULL, len, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (start != MAP_FAILED) {
+            *reserved = len;
+            return start;
+        }
+        /* no huge pages configured: fall back to transparent ones */
+        flags |= MPOOL_HUGE_THP;
+    }
+
+    if (flags & MPOOL_HUGE_THP) {
+        /* over-reserve so the region can start on a huge page boundary */
+        len = round_up(size, HUGE_PAGE);
+        start = mmap(NULL, len + HUGE_PAGE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (start == MAP_FAILED) return NULL;
+        aligned = (char *) round_up((uintptr_t) start, HUGE_PAGE);
+        if (aligned > start)
+            munmap(start, aligned - start);
+        munmap(aligned + len, start + HUGE_PAGE - aligned);
+        madvise(aligned, len, MADV_HUGEPAGE);
+        *reserved = len;
+        return aligned;
+    }
+
+    len = round_up(size ? size : 1, os_page_size());
+    start = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == MAP_FAILED) return NULL;
+    *reserved = len;
+    return start;
+}
+
+/* make [start, start + end) usable, given that [start, start + *committed)
+   already is; returns 0 if the memory cannot be committed */
+int os_commit(char *start, size_t *committed, size_t end, size_t reserved, unsigned flags)
+{
+    size_t chunk = flags & (MPOOL_HUGE_THP | MPOOL_HUGE_EXPLICIT) ? HUGE_PAGE : COMMIT_CHUNK;
+    size_t to = round_up(end, chunk);
+
+    if (end <= *committed) return 1;
+    if (to > reserved) to = reserved;
+    if (mprotect(start + *committed, to - *committed, PROT_READ | PROT_WRITE))
+        return 0;
+    *committed = to;
+    return 1;
+}
+
+/* make the pages of [start, start + len) accessible or not */
+int os_protect(char *start, size_t len, int access)
+{
+    return !mprotect(start, len, access ? PROT_READ | PROT_WRITE : PROT_NONE);
+}
+
+/* the pages os_purge releases: huge pages for pools backed by them */
+size_t os_purge_unit(unsigned flags)
+{
+    return flags & (MPOOL_HUGE_THP | MPOOL_HUGE_EXPLICIT) ? HUGE_PAGE : os_page_size();
+}
+
+/* hand the whole pages inside [start, start + len) back to the system,
+   keeping them mapped: they read as zero when next touched. Returns
+   the number of bytes released */
+size_t os_purge(char *start, size_t len, unsigned flags)
+{
+    size_t unit = os_purge_unit(flags);
+    uintptr_t from = round_up((uintptr_t) start, unit);
+    uintptr_t to = ((uintptr_t) start + len) & ~(unit - 1);
+
+    if (to <= from || madvise((void *) from, to - from, MADV_DONTNEED))
+        return 0;
+    return to - from;
+}
+
+void os_release(char *start, size_t reserved)
+{
+    munmap(start, reserved);
+}
+
+/* map `size` bytes of zeroed read-write memory for the pool's own
+   bookkeeping, so it never comes from the system heap */
+void *os_map(size_t size)
+{
+    void *mem = mmap(NULL, round_up(size, os_page_size()), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+void os_unmap(void *mem, size_t size)
+{
+    if (mem) munmap(mem, round_up(size, os_page_size()));
+}
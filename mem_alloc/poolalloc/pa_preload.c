@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   malloc interposer
+
+   Built as libpoolalloc.so, this serves the malloc family of an
+   unmodified program from one growable pool:
+
+       LD_PRELOAD=./libpoolalloc.so program
+
+   POOLALLOC_SIZE sets the size of the first arena in MiB (64 by
+   default). With POOLALLOC_TRACE=path each process records an
+   allocation trace for pa_replay to path.<pid>. POOLALLOC_GUARD=N
+   puts about one in N allocations between guard pages (MPOOL_GUARD),
+   so overflows and uses after free fault with a report of where the
+   block was allocated and freed. Errors the pool reports go to
+   stderr, since stdout belongs to the program.
+
+   The pool never calls malloc itself, but stdio may while it reports
+   an error or writes a trace under the pool lock. A call made while
+   the thread is already inside the pool is served from a static
+   bootstrap buffer instead, as are calls made while the pool is being
+   created. Bootstrap memory is never reused.
+ */
+
+#define EXPORT __attribute__((visibility("default")))
+#define BOOT_SIZE ((size_t) 64 << 10)
+#define DEFAULT_POOL_MB 64
+
+static struct memory_pool *pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static __thread int busy __attribute__((tls_model("initial-exec")));
+
+static char boot[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+
+static void *boot_alloc(size_t size, size_t align)
+{
+    size_t used, start;
+
+    do {
+        used = boot_used;
+        start = align_address(align, used);
+        if (start + size > BOOT_SIZE) return NULL;
+    } while (!__sync_bool_compare_and_swap(&boot_used, used, start + size));
+    return boot + start;
+}
+
+static int is_boot(void *addr)
+{
+    return (char *) addr >= boot && (char *) addr < boot + BOOT_SIZE;
+}
+
+/* with POOLALLOC_TRACE, trace this process to path.<pid> */
+static void start_trace(void)
+{
+    const char *env = getenv("POOLALLOC_TRACE");
+    char path[4096];
+
+    if (env) {
+        snprintf(path, sizeof(path), "%s.%d", env, (int) getpid());
+        mpool_trace_start(pool, path);
+    }
+}
+
+static void lock_pool(void) { pthread_mutex_lock(&pool->lock); }
+static void unlock_pool(void) { pthread_mutex_unlock(&pool->lock); }
+
+/* A child shares the file of the parent's trace, offset included, so
+   it drops its copy unwritten and starts a trace of its own */
+static void child_fork(void)
+{
+    struct mpool_trace *t = pool->trace;
+
+    pool->trace = NULL;
+    unlock_pool();
+    if (t) {
+        trace_discard(t);
+        start_trace();
+    }
+}
+
+static void pool_init(void)
+{
+    struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GROW | MPOOL_SMALL, 0 };
+    const char *env = getenv("POOLALLOC_SIZE");
+    size_t mb = env && atol(env) > 0 ? (size_t) atol(env) : DEFAULT_POOL_MB;
+
+    if ((env = getenv("POOLALLOC_GUARD")) && atol(env) > 0) {
+        opts.flags |= MPOOL_GUARD;
+        opts.guard_rate = atol(env);
+    }
+    busy = 1;
+    pool = mpool_create_opts(mb << 20, &opts);
+    if (pool) {
+        // Keep the pool consistent in a child forked while it is in use
+        pthread_atfork(lock_pool, unlock_pool, child_fork);
+        // Children that exec inherit the variable, so name traces by pid
+        start_trace();
+    }
+    busy = 0;
+}
+
+/* the pool, or NULL if this call must be served from boot */
+static struct memory_pool *get_pool(void)
+{
+    if (busy) return NULL;
+    pthread_once(&pool_once, pool_init);
+    return busy ? NULL : pool;
+}
+
+/* `site` is the caller's return address, for guarded allocations */
+static void *pa_alloc(size_t size, size_t align, void *site)
+{
+    struct memory_pool *p;
+    void *addr;
+
+    // Nothing this large can be allocated, and malloc must not report it
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    p = get_pool();
+    if (!size) size = 1;
+    if (!p) return boot_alloc(size, align);
+
+    busy = 1;
+    pthread_mutex_lock(&p->lock);
+    addr = guard_sample(p) ? guard_alloc(p, size, align, site) : NULL;
+    if (!addr) addr = pool_alloc(p, size, align);
+    if (p->trace) trace_alloc(p, addr, size);
+    pthread_mutex_unlock(&p->lock);
+    busy = 0;
+    if (!addr) errno = ENOMEM;
+    return addr;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    return pa_alloc(size, calc_align(size), __builtin_return_address(0));
+}
+
+EXPORT void free(void *addr)
+{
+    struct memory_pool *p;
+
+    if (!addr || is_boot(addr) || !(p = get_pool()))
+        return;
+
+    // Pointers the pool did not hand out are ignored rather than reported
+    busy = 1;
+    pthread_mutex_lock(&p->lock);
+    if (p->trace) trace_free(p, addr);
+    if (!p->guard || !guard_free(p, addr, __builtin_return_address(0))) {
+        if (pool_find(p, addr) || small_size(p, addr))
+            pool_free(p, addr);
+    }
+    pthread_mutex_unlock(&p->lock);
+    busy = 0;
+}
+
+EXPORT void *calloc(size_t n, size_t size)
+{
+    void *addr;
+
+    if (size && n > (size_t) -1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // Not malloc(): the compiler would fold malloc and memset back into calloc
+    addr = pa_alloc(n * size, calc_align(n * size), __builtin_return_address(0));
+    // Bootstrap memory is static and never reused, so already zero
+    if (addr && !is_boot(addr))
+        memset(addr, 0, n * size);
+    return addr;
+}
+
+EXPORT void *realloc(void *addr, size_t size)
+{
+    struct memory_pool *p;
+    void *moved;
+    size_t avail;
+
+    if (!addr) return malloc(size);
+    if (!size) {
+        free(addr);
+        return NULL;
+    }
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (is_boot(addr)) {
+        moved = malloc(size);
+        avail = boot + BOOT_SIZE - (char *) addr;
+        if (moved) memcpy(moved, addr, avail < size ? avail : size);
+        return moved;
+    }
+    if (!(p = get_pool()))
+        return NULL;
+
+    busy = 1;
+    moved = mpool_realloc(p, addr, size);
+    busy = 0;
+    if (!moved) errno = ENOMEM;
+    return moved;
+}
+
+EXPORT int posix_memalign(void **out, size_t align, size_t size)
+{
+    void *addr;
+
+    if (!align || (align & (align - 1)) || align % sizeof(void *))
+        return EINVAL;
+    addr = pa_alloc(size, align > calc_align(size) ? align : calc_align(size),
+                    __builtin_return_address(0));
+    if (!addr) return ENOMEM;
+    *out = addr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+    if (!align || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return pa_alloc(size, align > calc_align(size) ? align : calc_align(size),
+                    __builtin_return_address(0));
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return aligned_alloc(os_page_size(), size);
+}
+
+EXPORT size_t malloc_usable_size(void *addr)
+{
+    struct memory_pool *p;
+    size_t size;
+
+    if (!addr || is_boot(addr) || !(p = get_pool()))
+        return 0;
+    busy = 1;
+    size = mpool_usable_size(p, addr);
+    busy = 0;
+    return size;
+}
@@ -0,0 +1,240 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "dbll.h"
+#include "poolalloc.h"
+
+/* Replay an allocation trace recorded with mpool_trace_start against
+   poolalloc and against the system malloc, each in its own process.
+
+   For each allocator this reports the time per call, how far the peak
+   RSS rose above where it was before the replay, and the fragmentation
+   at the point where the most bytes were live: the share of the memory
+   the allocator holds that is not live data. Every allocation is
+   filled after it is made so that it shows up in the RSS; only the
+   allocator calls are timed. */
+
+#define SAMPLE_EVERY 1024
+
+struct replay {
+  struct mpool_trace_rec *recs;
+  size_t nrecs;
+  uint32_t nids;
+};
+
+struct allocator {
+  const char *name;
+  void *(*alloc)(size_t size);
+  void (*free)(void *addr);
+  void *(*realloc)(void *addr, size_t size);
+  size_t (*held)(void);
+};
+
+static struct memory_pool *pool;
+
+static void *pool_alloc_fn(size_t size) { return mpool_alloc(pool, size); }
+static void pool_free_fn(void *addr) { mpool_free(pool, addr); }
+static void *pool_realloc_fn(void *addr, size_t size) { return mpool_realloc(pool, addr, size); }
+
+/* only committed memory counts, the rest of a pool is address space */
+static size_t pool_held(void) {
+  struct mpool_arena *arena;
+  size_t held = 0;
+
+  for(arena = pool->arenas; arena; arena = arena->next)
+	held += arena->committed;
+  return held;
+}
+
+static size_t malloc_held(void) {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena + mi.hblkhd;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long rss_kb(void) {
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if(f) {
+	if(fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+	fclose(f);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int load(const char *path, struct replay *r) {
+  FILE *f = fopen(path, "rb");
+  struct mpool_trace_rec *rec;
+  char magic[8];
+  long len;
+  size_t i;
+
+  if(!f) {
+	printf("ERROR: cannot open %s\n", path);
+	return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  rewind(f);
+  if(len < 8 || fread(magic, 8, 1, f) != 1 || memcmp(magic, MPOOL_TRACE_MAGIC, 8)) {
+	printf("ERROR: %s is not an allocation trace\n", path);
+	fclose(f);
+	return 0;
+  }
+
+  r->nrecs = (len - 8) / sizeof(struct mpool_trace_rec);
+  r->recs = malloc(r->nrecs * sizeof(struct mpool_trace_rec) + 1);
+  if(!r->recs) {
+	printf("ERROR: cannot load %lu records from %s\n", r->nrecs, path);
+	fclose(f);
+	return 0;
+  }
+  r->nrecs = fread(r->recs, sizeof(struct mpool_trace_rec), r->nrecs, f);
+  fclose(f);
+
+  // Allocations are numbered in order, and only those made so far can be named
+  r->nids = 0;
+  for(i = 0; i < r->nrecs; i++) {
+	rec = &r->recs[i];
+	if(rec->op == MPOOL_TRACE_ALLOC ? rec->id != r->nids :
+	   rec->op > MPOOL_TRACE_REALLOC || rec->id >= r->nids) {
+	  printf("ERROR: %s is corrupt at record %lu (op %u, id %u)\n", path, i, rec->op, rec->id);
+	  free(r->recs);
+	  return 0;
+	}
+	if(rec->op == MPOOL_TRACE_ALLOC)
+	  r->nids++;
+  }
+  return 1;
+}
+
+static void run(struct replay *r, struct allocator *a) {
+  void **ptrs = calloc(r->nids + 1, sizeof(void *));
+  size_t *sizes = calloc(r->nids + 1, sizeof(size_t));
+  size_t i, live = 0, peak_live = 0, held = 0;
+  long rss0;
+  double t = 0, t0;
+  struct mpool_trace_rec *rec;
+  struct rusage ru;
+
+  if(!ptrs || !sizes) {
+	printf("ERROR: cannot track %u allocations\n", r->nids);
+	exit(1);
+  }
+  rss0 = rss_kb();
+  for(i = 0; i < r->nrecs; i++) {
+	rec = &r->recs[i];
+	t0 = now_ns();
+	switch(rec->op) {
+	case MPOOL_TRACE_ALLOC:
+	  ptrs[rec->id] = a->alloc(rec->size);
+	  break;
+	case MPOOL_TRACE_FREE:
+	  if(ptrs[rec->id]) a->free(ptrs[rec->id]);
+	  break;
+	case MPOOL_TRACE_REALLOC:
+	  ptrs[rec->id] = a->realloc(ptrs[rec->id], rec->size);
+	  break;
+	}
+	t += now_ns() - t0;
+
+	live -= sizes[rec->id];
+	sizes[rec->id] = 0;
+	if(rec->op == MPOOL_TRACE_FREE)
+	  ptrs[rec->id] = NULL;
+	else if(ptrs[rec->id]) {
+	  memset(ptrs[rec->id], 0xa5, rec->size);
+	  sizes[rec->id] = rec->size;
+	  live += rec->size;
+	}
+
+	if(i % SAMPLE_EVERY == 0 && live > peak_live) {
+	  peak_live = live;
+	  held = a->held();
+	}
+  }
+
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-12s %12lu %10.1f %14ld %8.3f\n", a->name, r->nrecs,
+		 r->nrecs ? t / r->nrecs : 0, ru.ru_maxrss - rss0,
+		 held ? 1.0 - (double) peak_live / held : 0);
+  free(sizes);
+  free(ptrs);
+}
+
+/* replay in a child process so that each allocator has its own RSS;
+   returns 0 if the replay did not finish */
+static int run_forked(struct replay *r, struct allocator *a) {
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  pid = fork();
+  if(pid == 0) {
+	run(r, a);
+	exit(0);
+  }
+  if(pid < 0 || waitpid(pid, &status, 0) != pid) {
+	printf("ERROR: cannot run the %s replay\n", a->name);
+	return 0;
+  }
+  if(WIFSIGNALED(status)) {
+	printf("ERROR: the %s replay died of signal %d\n", a->name, WTERMSIG(status));
+	return 0;
+  }
+  if(WEXITSTATUS(status)) {
+	printf("ERROR: the %s replay failed\n", a->name);
+	return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GROW, 0 };
+  struct allocator pa = { "poolalloc", pool_alloc_fn, pool_free_fn, pool_realloc_fn, pool_held };
+  struct allocator libc = { "malloc", malloc, free, realloc, malloc_held };
+  struct replay r;
+  int ok;
+
+  if(argc < 2 || argc > 3) {
+	printf("usage: %s TRACE [segregated|bestfit|buddy]\n", argv[0]);
+	return 1;
+  }
+  if(argc == 3) {
+	if(!strcmp(argv[2], "bestfit")) opts.policy = MPOOL_BESTFIT;
+	else if(!strcmp(argv[2], "buddy")) opts.policy = MPOOL_BUDDY;
+	else if(strcmp(argv[2], "segregated")) {
+	  printf("ERROR: unknown policy %s\n", argv[2]);
+	  return 1;
+	}
+  }
+  if(!load(argv[1], &r))
+	return 1;
+
+  pool = mpool_create_opts(1 << 20, &opts);
+  if(!pool) {
+	printf("ERROR: cannot create pool\n");
+	return 1;
+  }
+
+  printf("%-12s %12s %10s %14s %8s\n", "allocator", "ops", "ns/op", "peak RSS KiB", "frag");
+  ok = run_forked(&r, &pa);
+  ok = run_forked(&r, &libc) && ok;
+
+  mpool_destroy(pool);
+  free(r.recs);
+  return !ok;
+}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   slab allocator for fixed-size objects
+
+   Each page starts with a link to the next page of the slab, followed
+   by page_size / slot_size slots. Pages are only handed back to the
+   pool when the slab is destroyed.
+ */
+
+#define SLAB_PAGE 4096
+#define SLAB_MIN_SLOTS 8
+
+struct mpool_slab *mpool_slab_create(struct memory_pool *p, size_t obj_size, size_t align)
+{
+    struct mpool_slab *s;
+
+    if (!obj_size || (align & (align - 1))) return NULL;
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    s = calloc(sizeof(struct mpool_slab), 1);
+    if (!s) return NULL;
+
+    s->pool = p;
+    s->align = align;
+    s->slot_size = (obj_size + align - 1) & ~(align - 1);
+    s->page_size = SLAB_PAGE;
+    if (s->page_size < align + SLAB_MIN_SLOTS * s->slot_size)
+        s->page_size = align + SLAB_MIN_SLOTS * s->slot_size;
+    return s;
+}
+
+void mpool_slab_destroy(struct mpool_slab *s)
+{
+    void *page, *next;
+
+    pthread_mutex_lock(&s->pool->lock);
+    for (page = s->pages; page; page = next) {
+        next = *(void **) page;
+        pool_free(s->pool, page);
+    }
+    pthread_mutex_unlock(&s->pool->lock);
+    free(s);
+}
+
+/* take a page from the pool and chain all of its slots onto the free list */
+static int slab_grow(struct mpool_slab *s)
+{
+    char *page, *slot, *end;
+
+    pthread_mutex_lock(&s->pool->lock);
+    page = pool_alloc(s->pool, s->page_size, s->align);
+    pthread_mutex_unlock(&s->pool->lock);
+    if (!page) return 0;
+
+    *(void **) page = s->pages;
+    s->pages = page;
+
+    end = page + s->page_size - s->slot_size;
+    for (slot = page + s->align; slot <= end; slot += s->slot_size) {
+        *(void **) slot = s->free;
+        s->free = slot;
+    }
+    return 1;
+}
+
+void *mpool_slab_alloc(struct mpool_slab *s)
+{
+    void *obj;
+
+    if (!s->free && !slab_grow(s))
+        return NULL;
+    obj = s->free;
+    s->free = *(void **) obj;
+    return obj;
+}
+
+void mpool_slab_free(struct mpool_slab *s, void *obj)
+{
+    if (!obj) return;
+    *(void **) obj = s->free;
+    s->free = obj;
+}
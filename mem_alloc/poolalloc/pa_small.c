@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stdio.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   bitmap allocator for small blocks
+
+   With MPOOL_SMALL, requests of up to MPOOL_SMALL_MAX bytes are served from
+   runs: RUN_SIZE blocks taken from the pool, aligned to their size and
+   cut into equal slots of one size class. A run's header holds a bit
+   per slot, set while the slot is free, and a summary word with a bit
+   per non-empty bitmap word, so a free slot is found with two
+   count-trailing-zeros. Slots have no record of their own; a freed
+   address is matched to its run by masking it down to RUN_SIZE and
+   checking that the pool handed out a run there.
+
+   Runs with free slots are kept on a list per class. A run that
+   empties goes back to the pool unless it is the last one of its
+   class. The run blocks count as in use for mpool_stats, the slots in
+   them only for the alloc/free counters.
+ */
+
+#define RUN_SIZE ((size_t) 16 << 10)
+#define RUN_WORDS (RUN_SIZE / 8 / 64)
+
+struct small_run {
+    uint64_t summary;               /* bit w: map[w] has a free slot */
+    uint64_t map[RUN_WORDS];        /* bit set: slot is free */
+    struct small_run *next, *prev;  /* runs of the class with free slots */
+    unsigned cls;
+    unsigned nslots;
+    unsigned nfree;
+};
+
+/* slots start after the header, 16-byte aligned */
+#define RUN_DATA ((sizeof(struct small_run) + 15) & ~(size_t) 15)
+
+/* 8-byte slots for up to 8 bytes, then 16-byte steps */
+static unsigned small_class(size_t size)
+{
+    return size <= 8 ? 0 : (size + 15) / 16;
+}
+
+static size_t class_size(unsigned c)
+{
+    return c ? c * 16 : 8;
+}
+
+static void run_unlink(struct memory_pool *p, struct small_run *run)
+{
+    if (run->prev) run->prev->next = run->next;
+    else p->small[run->cls] = run->next;
+    if (run->next) run->next->prev = run->prev;
+    run->next = run->prev = NULL;
+}
+
+static void run_push(struct memory_pool *p, struct small_run *run)
+{
+    run->prev = NULL;
+    run->next = p->small[run->cls];
+    if (run->next) run->next->prev = run;
+    p->small[run->cls] = run;
+}
+
+static struct small_run *run_create(struct memory_pool *p, unsigned c)
+{
+    struct small_run *run = pool_alloc(p, RUN_SIZE, RUN_SIZE);
+    unsigned i;
+
+    if (!run) return NULL;
+    // The run is not an allocation as far as the counters go
+    p->nalloc--;
+    p->size_hist[stat_class(RUN_SIZE)]--;
+    pool_find(p, run)->is_run = 1;
+
+    run->cls = c;
+    run->nslots = (RUN_SIZE - RUN_DATA) / class_size(c);
+    run->nfree = run->nslots;
+    run->summary = 0;
+    for (i = 0; i < RUN_WORDS; i++) {
+        if (i * 64 >= run->nslots)
+            run->map[i] = 0;
+        else if (run->nslots - i * 64 >= 64)
+            run->map[i] = ~(uint64_t) 0;
+        else
+            run->map[i] = ((uint64_t) 1 << (run->nslots - i * 64)) - 1;
+        if (run->map[i])
+            run->summary |= (uint64_t) 1 << i;
+    }
+    run_push(p, run);
+    return run;
+}
+
+/* a slot for `size` bytes, size <= MPOOL_SMALL_MAX */
+void *small_alloc(struct memory_pool *p, size_t size)
+{
+    unsigned c = small_class(size), w, b;
+    struct small_run *run = p->small[c];
+
+    if (!run && !(run = run_create(p, c)))
+        return NULL;
+
+    w = __builtin_ctzll(run->summary);
+    b = __builtin_ctzll(run->map[w]);
+    run->map[w] &= run->map[w] - 1;
+    if (!run->map[w])
+        run->summary &= ~((uint64_t) 1 << w);
+    if (!--run->nfree)
+        run_unlink(p, run);
+
+    p->nalloc++;
+    p->size_hist[stat_class(size)]++;
+    return (char *) run + RUN_DATA + (size_t) (w * 64 + b) * class_size(c);
+}
+
+/* the run holding the slot at `addr`, or NULL if it is not a slot */
+static struct small_run *small_run_of(struct memory_pool *p, void *addr)
+{
+    struct small_run *run = (struct small_run *) ((uintptr_t) addr & ~(RUN_SIZE - 1));
+    struct alloc_info *block;
+
+    if ((char *) addr < (char *) run + RUN_DATA)
+        return NULL;
+    block = pool_find(p, run);
+    if (!block || !block->is_run)
+        return NULL;
+    if (((char *) addr - (char *) run - RUN_DATA) % class_size(run->cls))
+        return NULL;
+    return run;
+}
+
+/* size of the slot at `addr`, or 0 if it is not a small slot */
+size_t small_size(struct memory_pool *p, void *addr)
+{
+    struct small_run *run = small_run_of(p, addr);
+
+    return run ? class_size(run->cls) : 0;
+}
+
+/* free the slot at `addr`; returns 0 if it is not a small slot */
+int small_free(struct memory_pool *p, void *addr)
+{
+    struct small_run *run = small_run_of(p, addr);
+    size_t slot;
+
+    if (!run) return 0;
+    slot = ((char *) addr - (char *) run - RUN_DATA) / class_size(run->cls);
+    if (run->map[slot / 64] & ((uint64_t) 1 << (slot % 64))) {
+        POOL_ERROR("ERROR: double free of small block %p\n", addr);
+        return 1;
+    }
+
+    run->map[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    run->summary |= (uint64_t) 1 << (slot / 64);
+    p->nfree++;
+    if (run->nfree++ == 0)
+        run_push(p, run);
+    else if (run->nfree == run->nslots && (run->prev || run->next)) {
+        run_unlink(p, run);
+        pool_free(p, run);
+        p->nfree--;
+    }
+    return 1;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   pool statistics
+
+   The counters are plain fields of the pool bumped under the lock the
+   operation already holds, so they are always on. Free space is only
+   measured when mpool_stats is called, by walking the free blocks.
+ */
+
+static void count_free(struct mpool_stats *out, size_t size)
+{
+    if (!size) return;
+    out->free += size;
+    out->free_blocks++;
+    if (size > out->largest_free)
+        out->largest_free = size;
+}
+
+void mpool_stats(struct memory_pool *p, struct mpool_stats *out)
+{
+    struct mpool_arena *arena;
+    struct alloc_info *block;
+    struct llnode *n;
+
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&p->lock);
+
+    if (p->policy == MPOOL_ARENA) {
+        // Only the rest of the current arena and the arenas after it are free
+        count_free(out, p->bump_arena->size - p->bump);
+        for (arena = p->bump_arena->next; arena; arena = arena->next)
+            count_free(out, arena->size);
+    }
+    else {
+        for (n = p->free_list->first; n; n = n->next)
+            count_free(out, ((struct alloc_info *) n->user_data)->size);
+        for (block = p->deferred; block; block = block->bin_next)
+            out->deferred += block->size;
+    }
+
+    out->total = p->total_size;
+    out->in_use = p->in_use;
+    out->high_water = p->high_water;
+    out->purged = p->purged;
+    out->allocs = p->nalloc;
+    out->frees = p->nfree;
+    out->failures = p->nfail;
+    memcpy(out->size_hist, p->size_hist, sizeof(out->size_hist));
+    pthread_mutex_unlock(&p->lock);
+
+    if (out->free)
+        out->fragmentation = 1.0 - (double) out->largest_free / out->free;
+}
+
+/* write the stats as one "name value" line each, for scraping */
+void mpool_stats_print(struct memory_pool *p, FILE *out)
+{
+    struct mpool_stats s;
+    int i;
+
+    mpool_stats(p, &s);
+    fprintf(out, "mpool_bytes_total %zu\n", s.total);
+    fprintf(out, "mpool_bytes_in_use %zu\n", s.in_use);
+    fprintf(out, "mpool_bytes_free %zu\n", s.free);
+    fprintf(out, "mpool_bytes_high_water %zu\n", s.high_water);
+    fprintf(out, "mpool_largest_free_block %zu\n", s.largest_free);
+    fprintf(out, "mpool_free_blocks %zu\n", s.free_blocks);
+    fprintf(out, "mpool_bytes_deferred %zu\n", s.deferred);
+    fprintf(out, "mpool_bytes_purged_total %zu\n", s.purged);
+    fprintf(out, "mpool_fragmentation %.4f\n", s.fragmentation);
+    fprintf(out, "mpool_allocs_total %lu\n", s.allocs);
+    fprintf(out, "mpool_frees_total %lu\n", s.frees);
+    fprintf(out, "mpool_alloc_failures_total %lu\n", s.failures);
+    for (i = 0; i < MPOOL_STAT_CLASSES; i++)
+        if (s.size_hist[i])
+            fprintf(out, "mpool_allocs_by_size{le=\"%lu\"} %lu\n", 1UL << i, s.size_hist[i]);
+}
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   thread-local caches for a shared memory pool
+
+   Blocks sitting in a magazine stay allocated as far as the pool is
+   concerned; they only go back through pool_free when a magazine
+   overflows or the cache is destroyed. mpool_tcache_free cannot tell a
+   block's size class from its address without the pool's tag table, so
+   frees are parked in `pending` and sorted into magazines under the
+   lock, together with the next refill.
+
+   A free from a thread other than the owner must not touch the
+   magazines, so it is pushed onto the remote ring instead (a bounded
+   MPSC queue after Vyukov). Producers claim a position with a CAS on
+   remote_tail and publish the slot by bumping its sequence number; the
+   owner moves published slots into `pending` at the start of its next
+   allocation, without the pool lock. If the ring is full the free falls
+   back to mpool_free.
+ */
+
+#define REMOTE_MASK (MPOOL_TCACHE_REMOTE - 1)
+
+static unsigned tcache_class(size_t size)
+{
+    return (size - 1) / 16;
+}
+
+/* sort parked frees into their magazines; the caller holds the lock */
+static void tcache_drain(struct mpool_tcache *tc)
+{
+    struct memory_pool *p = tc->pool;
+    struct alloc_info *block;
+    struct mpool_magazine *mag;
+    size_t size;
+    unsigned i;
+
+    for (i = 0; i < tc->npending; i++) {
+        block = pool_find(p, tc->pending[i]);
+        if (block)
+            size = block->request_size;
+        else
+            size = p->flags & MPOOL_SMALL ? small_size(p, tc->pending[i]) : 0;
+        if (size && size % 16 == 0 && size <= MPOOL_TCACHE_MAX) {
+            mag = &tc->mags[tcache_class(size)];
+            if (mag->count < MPOOL_TCACHE_SLOTS) {
+                mag->slots[mag->count++] = tc->pending[i];
+                continue;
+            }
+        }
+        pool_free(p, tc->pending[i]);
+    }
+    tc->npending = 0;
+}
+
+static int remote_push(struct mpool_tcache *tc, void *addr)
+{
+    unsigned long pos = __atomic_load_n(&tc->remote_tail, __ATOMIC_RELAXED);
+    unsigned long seq;
+    long dif;
+
+    for (;;) {
+        seq = __atomic_load_n(&tc->remote[pos & REMOTE_MASK].seq, __ATOMIC_ACQUIRE);
+        dif = (long) (seq - pos);
+        if (dif < 0)
+            return 0;   /* full: the owner has not caught up */
+        if (dif == 0 && __atomic_compare_exchange_n(&tc->remote_tail, &pos, pos + 1, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        if (dif > 0)
+            pos = __atomic_load_n(&tc->remote_tail, __ATOMIC_RELAXED);
+    }
+    tc->remote[pos & REMOTE_MASK].addr = addr;
+    __atomic_store_n(&tc->remote[pos & REMOTE_MASK].seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int remote_ready(struct mpool_tcache *tc)
+{
+    unsigned long pos = tc->remote_head;
+
+    return __atomic_load_n(&tc->remote[pos & REMOTE_MASK].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/* move remote frees into `pending` until either runs out; returns how
+   many were moved */
+static unsigned remote_drain(struct mpool_tcache *tc)
+{
+    unsigned long pos;
+    unsigned n = 0;
+
+    while (tc->npending < MPOOL_TCACHE_SLOTS && remote_ready(tc)) {
+        pos = tc->remote_head++;
+        tc->pending[tc->npending++] = tc->remote[pos & REMOTE_MASK].addr;
+        __atomic_store_n(&tc->remote[pos & REMOTE_MASK].seq, pos + MPOOL_TCACHE_REMOTE,
+                         __ATOMIC_RELEASE);
+        n++;
+    }
+    return n;
+}
+
+struct mpool_tcache *mpool_tcache_create(struct memory_pool *p)
+{
+    struct mpool_tcache *tc = calloc(sizeof(struct mpool_tcache), 1);
+    unsigned i;
+
+    if (!tc) return NULL;
+
+    tc->pool = p;
+    tc->owner = pthread_self();
+    for (i = 0; i < MPOOL_TCACHE_REMOTE; i++)
+        tc->remote[i].seq = i;
+    return tc;
+}
+
+/* return every cached block to the pool */
+void mpool_tcache_destroy(struct mpool_tcache *tc)
+{
+    struct memory_pool *p = tc->pool;
+    unsigned c;
+
+    pthread_mutex_lock(&p->lock);
+    do tcache_drain(tc);
+    while (remote_drain(tc));
+    for (c = 0; c < MPOOL_TCACHE_CLASSES; c++) {
+        while (tc->mags[c].count)
+            pool_free(p, tc->mags[c].slots[--tc->mags[c].count]);
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(tc);
+}
+
+void *mpool_tcache_alloc(struct mpool_tcache *tc, size_t size)
+{
+    struct mpool_magazine *mag;
+    void *addr;
+
+    if (!size) return NULL;
+    if (size > MPOOL_TCACHE_MAX)
+        return mpool_alloc(tc->pool, size);
+    if (remote_ready(tc))
+        remote_drain(tc);
+
+    mag = &tc->mags[tcache_class(size)];
+    if (mag->count)
+        return mag->slots[--mag->count];
+
+    /* miss: sort parked frees, then refill a batch from the pool */
+    pthread_mutex_lock(&tc->pool->lock);
+    do tcache_drain(tc);
+    while (remote_drain(tc));
+    while (mag->count < MPOOL_TCACHE_BATCH) {
+        addr = pool_alloc(tc->pool, (tcache_class(size) + 1) * 16, 16);
+        if (!addr) break;
+        mag->slots[mag->count++] = addr;
+    }
+    pthread_mutex_unlock(&tc->pool->lock);
+
+    return mag->count ? mag->slots[--mag->count] : NULL;
+}
+
+void mpool_tcache_free(struct mpool_tcache *tc, void *addr)
+{
+    if (!addr) return;
+
+    if (!pthread_equal(pthread_self(), tc->owner)) {
+        if (!remote_push(tc, addr))
+            mpool_free(tc->pool, addr);
+        return;
+    }
+    if (tc->npending == MPOOL_TCACHE_SLOTS) {
+        pthread_mutex_lock(&tc->pool->lock);
+        tcache_drain(tc);
+        pthread_mutex_unlock(&tc->pool->lock);
+    }
+    tc->pending[tc->npending++] = addr;
+}
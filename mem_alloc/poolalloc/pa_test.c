@@ -1,6 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "dbll.h"
 #include "poolalloc.h"
@@ -91,6 +101,1164 @@ int test_create_destroy(size_t poolsize) {
   return ret;
 }
 
+int test_size_classes() {
+  struct memory_pool *p;
+  int i;
+  int ret = 1;
+  size_t sz[] = {24, 48, 100, 200, 700, 3000};
+  char *alloc[60];
+  char *again;
+
+  p = mpool_create(65536);
+
+  if(!(ret = th_check(p != NULL, "mpool_create returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; ret && i < 60; i++) {
+	alloc[i] = mpool_alloc(p, sz[i % 6]);
+	ret = th_check(alloc[i] != NULL, "mpool_alloc (%p) for sz %lu is non-null", alloc[i], sz[i % 6]) && ret;
+  }
+
+  /* punch a hole of every size, each one surrounded by live blocks */
+  for(i = 6; ret && i < 42; i += 7)
+	mpool_free(p, alloc[i]);
+
+  for(i = 41; ret && i >= 6; i -= 7) {
+	again = mpool_alloc(p, sz[i % 6]);
+	ret = th_check(again == alloc[i], "mpool_alloc (%p) for sz %lu reuses the freed block of its class (%p)", again, sz[i % 6], alloc[i]) && ret;
+  }
+
+  for(i = 0; ret && i < 60; i++)
+	mpool_free(p, alloc[i]);
+
+  if(ret) {
+	again = mpool_alloc(p, 65536);
+	ret = th_check(again == p->start, "mpool_alloc (%p) of the whole pool after freeing everything", again) && ret;
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* requests too large to ever fit must fail rather than wrap around */
+int test_too_large(void) {
+  enum mpool_policy policies[] = { MPOOL_SEGREGATED, MPOOL_BESTFIT, MPOOL_BUDDY, MPOOL_ARENA };
+  struct mpool_opts opts = { MPOOL_SEGREGATED, 0, 0 };
+  struct memory_pool *p;
+  void *addr;
+  int i, grow;
+  int ret = 1;
+
+  for(i = 0; i < 8; i++) {
+	opts.policy = policies[i % 4];
+	grow = i >= 4;
+	opts.flags = grow ? MPOOL_GROW : 0;
+	p = mpool_create_opts(4096, &opts);
+	if(!(ret = th_check(p != NULL, "mpool_create_opts (policy %d) returned non-null (%p)", opts.policy, p) && ret))
+	  return 0;
+
+	addr = mpool_alloc(p, SIZE_MAX);
+	ret = th_check(addr == NULL, "mpool_alloc of SIZE_MAX fails (policy %d, grow %d, %p)", opts.policy, grow, addr) && ret;
+	addr = mpool_alloc(p, SIZE_MAX - 8);
+	ret = th_check(addr == NULL, "mpool_alloc of SIZE_MAX - 8 fails (policy %d, grow %d, %p)", opts.policy, grow, addr) && ret;
+	addr = mpool_alloc_aligned(p, PTRDIFF_MAX - 100, 4096);
+	ret = th_check(addr == NULL, "mpool_alloc_aligned past PTRDIFF_MAX fails (policy %d, grow %d, %p)", opts.policy, grow, addr) && ret;
+	addr = mpool_alloc(p, 100);
+	ret = th_check(addr != NULL, "the pool still allocates afterwards (%p)", addr) && ret;
+
+	mpool_destroy(p);
+  }
+
+  return ret;
+}
+
+int test_free_coalesce(enum mpool_policy policy) {
+  struct mpool_opts opts = { policy };
+  struct memory_pool *p;
+  struct alloc_info *ai;
+  int i, j;
+  int ret = 1;
+  char *alloc[500];
+  char *tmp;
+
+  p = mpool_create_opts(1 << 20, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts(policy %d) returned non-null (%p)", policy, p)))
+	return 0;
+
+  for(i = 0; ret && i < 500; i++) {
+	alloc[i] = mpool_alloc(p, 1 + (i * 37) % 1500);
+	ret = ret && th_check(alloc[i] != NULL, "mpool_alloc (%p) #%d is non-null", alloc[i], i);
+  }
+
+  /* free in a scrambled order so blocks merge from both sides */
+  srand(1);
+  for(i = 499; ret && i > 0; i--) {
+	j = rand() % (i + 1);
+	tmp = alloc[i]; alloc[i] = alloc[j]; alloc[j] = tmp;
+  }
+  for(i = 0; ret && i < 500; i++)
+	mpool_free(p, alloc[i]);
+
+  ret = ret && th_check(p->alloc_list->first == NULL, "alloc_list is empty after freeing everything");
+  ret = ret && th_check(p->free_list->first != NULL && p->free_list->first == p->free_list->last, "free_list has a single block after freeing everything");
+
+  if(ret) {
+	ai = (struct alloc_info *) p->free_list->first->user_data;
+	ret = th_check(ai->offset == 0 && ai->size == p->size, "free block covers the pool (offset %lu, size %lu)", ai->offset, ai->size) && ret;
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+static unsigned next_rand(unsigned *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16;
+}
+
+int test_bestfit() {
+  struct mpool_opts opts = { MPOOL_BESTFIT };
+  struct memory_pool *p;
+  size_t sz[] = {304, 16, 208, 16, 400, 16, 224, 16};
+  char *alloc[8];
+  char *fit;
+  int i;
+  int ret = 1;
+
+  p = mpool_create_opts(4096, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; ret && i < 8; i++) {
+	alloc[i] = mpool_alloc(p, sz[i]);
+	ret = th_check(alloc[i] != NULL, "mpool_alloc (%p) for sz %lu is non-null", alloc[i], sz[i]) && ret;
+  }
+
+  /* leave holes of 304, 208, 400 and 224 bytes behind live blocks */
+  for(i = 0; ret && i < 8; i += 2)
+	mpool_free(p, alloc[i]);
+
+  if(ret) {
+	fit = mpool_alloc(p, 200);
+	ret = th_check(fit == alloc[2], "best fit for 200 bytes is the 208-byte hole (%p, got %p)", alloc[2], fit) && ret;
+	fit = mpool_alloc(p, 220);
+	ret = th_check(fit == alloc[6], "best fit for 220 bytes is the 224-byte hole (%p, got %p)", alloc[6], fit) && ret;
+	fit = mpool_alloc(p, 300);
+	ret = th_check(fit == alloc[0], "best fit for 300 bytes is the 304-byte hole (%p, got %p)", alloc[0], fit) && ret;
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_buddy() {
+  struct mpool_opts opts = { MPOOL_BUDDY };
+  struct memory_pool *p;
+  struct alloc_info *ai;
+  struct llnode *n;
+  size_t sz[] = {1, 100, 16, 200, 33, 64};
+  char *alloc[6];
+  int i, nfree;
+  int ret = 1;
+
+  /* 1000 bytes start out as free blocks of 512, 256, 128, 64 and 32 */
+  p = mpool_create_opts(1000, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; ret && i < 6; i++) {
+	alloc[i] = mpool_alloc(p, sz[i]);
+	ret = th_check(alloc[i] != NULL, "mpool_alloc (%p) for sz %lu is non-null", alloc[i], sz[i]) && ret;
+  }
+
+  for(n = p->alloc_list->first; ret && n; n = n->next) {
+	ai = n->user_data;
+	ret = th_check((ai->size & (ai->size - 1)) == 0, "buddy block size %lu is a power of two", ai->size) && ret;
+	ret = th_check(ai->offset % ai->size == 0, "buddy block at %lu is aligned to its size %lu", ai->offset, ai->size) && ret;
+	ret = th_check(ai->size >= ai->request_size && ai->size < 2 * ai->request_size + 16, "buddy block size %lu is the smallest order for %lu bytes", ai->size, ai->request_size) && ret;
+  }
+
+  for(i = 0; ret && i < 6; i++)
+	mpool_free(p, alloc[i]);
+
+  nfree = 0;
+  for(n = p->free_list->first; n; n = n->next)
+	nfree++;
+  ret = th_check(nfree == 5, "freeing everything merges back to the 5 initial blocks (%d)", nfree) && ret;
+
+  if(ret) {
+	alloc[0] = mpool_alloc(p, 512);
+	ret = th_check(alloc[0] == p->start, "mpool_alloc (%p) of 512 bytes gets the whole first block", alloc[0]) && ret;
+  }
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+struct tcache_worker {
+  struct memory_pool *p;
+  int id;
+  int ok;
+};
+
+static void *tcache_worker(void *arg) {
+  struct tcache_worker *w = arg;
+  struct mpool_tcache *tc = mpool_tcache_create(w->p);
+  char *live[64] = {0};
+  size_t sz[64] = {0};
+  unsigned seed = w->id;
+  int i, k;
+  size_t j;
+
+  w->ok = tc != NULL;
+  for(i = 0; w->ok && i < 20000; i++) {
+	k = next_rand(&seed) % 64;
+	if(live[k]) {
+	  /* every byte must still carry our mark: no one else got the block */
+	  for(j = 0; j < sz[k]; j++)
+		if(live[k][j] != (char) (w->id + k)) w->ok = 0;
+	  mpool_tcache_free(tc, live[k]);
+	  live[k] = NULL;
+	} else {
+	  sz[k] = 1 + next_rand(&seed) % 300;
+	  live[k] = mpool_tcache_alloc(tc, sz[k]);
+	  if(!live[k]) w->ok = 0;
+	  else memset(live[k], w->id + k, sz[k]);
+	}
+  }
+  for(k = 0; k < 64; k++)
+	if(live[k]) mpool_tcache_free(tc, live[k]);
+  if(tc) mpool_tcache_destroy(tc);
+  return NULL;
+}
+
+int test_tcache() {
+  struct memory_pool *p;
+  struct tcache_worker w[4];
+  pthread_t th[4];
+  int i;
+  int ret = 1;
+
+  p = mpool_create(1 << 20);
+
+  if(!(ret = th_check(p != NULL, "mpool_create returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; i < 4; i++) {
+	w[i].p = p;
+	w[i].id = i * 64;
+	pthread_create(&th[i], NULL, tcache_worker, &w[i]);
+  }
+  for(i = 0; i < 4; i++) {
+	pthread_join(th[i], NULL);
+	ret = th_check(w[i].ok, "tcache worker %d saw only its own blocks", i) && ret;
+  }
+
+  ret = th_check(p->alloc_list->first == NULL, "every cached block went back to the pool") && ret;
+  ret = ret && th_check(p->free_list->first == p->free_list->last, "free_list has a single block after the caches are destroyed");
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* a producer allocates messages from its tcache and a consumer frees
+   them back to it through the remote queue */
+#define REMOTE_MSGS 20000
+#define REMOTE_QUEUE 64
+
+struct remote_pipe {
+  struct memory_pool *p;
+  struct mpool_tcache *tc;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *queue[REMOTE_QUEUE];
+  int head, count;
+  int ok;
+};
+
+static void *remote_consumer(void *arg) {
+  struct remote_pipe *rp = arg;
+  char *msg;
+
+  for(;;) {
+	pthread_mutex_lock(&rp->lock);
+	while(!rp->count)
+	  pthread_cond_wait(&rp->cond, &rp->lock);
+	msg = rp->queue[rp->head];
+	rp->head = (rp->head + 1) % REMOTE_QUEUE;
+	rp->count--;
+	pthread_cond_signal(&rp->cond);
+	pthread_mutex_unlock(&rp->lock);
+	if(!msg)
+	  return NULL;
+	if(msg[0] != msg[47]) rp->ok = 0;
+	mpool_tcache_free(rp->tc, msg);
+  }
+}
+
+static void *remote_producer(void *arg) {
+  struct remote_pipe *rp = arg;
+  pthread_t th;
+  char *msg;
+  int i;
+
+  rp->tc = mpool_tcache_create(rp->p);
+  pthread_create(&th, NULL, remote_consumer, rp);
+  for(i = 0; i <= REMOTE_MSGS; i++) {
+	msg = NULL;
+	if(i < REMOTE_MSGS) {
+	  if(!(msg = mpool_tcache_alloc(rp->tc, 48))) rp->ok = 0;
+	  else memset(msg, i, 48);
+	}
+	pthread_mutex_lock(&rp->lock);
+	while(rp->count == REMOTE_QUEUE)
+	  pthread_cond_wait(&rp->cond, &rp->lock);
+	rp->queue[(rp->head + rp->count) % REMOTE_QUEUE] = msg;
+	rp->count++;
+	pthread_cond_signal(&rp->cond);
+	pthread_mutex_unlock(&rp->lock);
+	if(!msg && i < REMOTE_MSGS)
+	  break;
+  }
+  pthread_join(th, NULL);
+  /* the owner picks up the last remote frees on its next allocation */
+  mpool_tcache_free(rp->tc, mpool_tcache_alloc(rp->tc, 48));
+  mpool_tcache_destroy(rp->tc);
+  return NULL;
+}
+
+int test_tcache_remote() {
+  struct remote_pipe rp;
+  struct mpool_stats s;
+  pthread_t th;
+  int ret = 1;
+
+  memset(&rp, 0, sizeof(rp));
+  rp.p = mpool_create(1 << 20);
+  rp.ok = 1;
+  pthread_mutex_init(&rp.lock, NULL);
+  pthread_cond_init(&rp.cond, NULL);
+
+  if(!(ret = th_check(rp.p != NULL, "mpool_create returned non-null (%p)", rp.p)))
+	return 0;
+
+  pthread_create(&th, NULL, remote_producer, &rp);
+  pthread_join(th, NULL);
+  ret = th_check(rp.ok, "every message reached the consumer intact") && ret;
+
+  mpool_stats(rp.p, &s);
+  ret = th_check(s.allocs < REMOTE_MSGS / 10, "remote frees were reused by the owner (%lu pool allocations)",
+				 s.allocs) && ret;
+  ret = th_check(rp.p->alloc_list->first == NULL, "every message went back to the pool") && ret;
+
+  pthread_cond_destroy(&rp.cond);
+  pthread_mutex_destroy(&rp.lock);
+  mpool_destroy(rp.p);
+
+  return ret;
+}
+
+int test_tcache_new() {
+  struct memory_pool *p;
+  struct mpool_tcache *tc;
+  struct llnode *n[3];
+  struct wide { char c[40]; } __attribute__((aligned(64))) *w;
+  unsigned c = (sizeof(struct llnode) - 1) / 16;
+  int ret = 1;
+
+  p = mpool_create(1 << 20);
+
+  if(!(ret = th_check(p != NULL, "mpool_create returned non-null (%p)", p)))
+	return 0;
+  tc = mpool_tcache_create(p);
+
+  n[0] = MPOOL_NEW(tc, struct llnode);
+  ret = th_check(n[0] && (uintptr_t) n[0] % 16 == 0, "MPOOL_NEW refills on a miss (%p)", n[0]) && ret;
+  ret = th_check(tc->mags[c].count == MPOOL_TCACHE_BATCH - 1, "the rest of the batch is cached (%u)",
+				 tc->mags[c].count) && ret;
+  n[1] = MPOOL_NEW(tc, struct llnode);
+  n[2] = MPOOL_NEW(tc, struct llnode);
+  ret = th_check(n[1] && n[2] && n[1] != n[0] && n[2] != n[1] && tc->mags[c].count == MPOOL_TCACHE_BATCH - 3,
+				 "MPOOL_NEW hits pop the magazine") && ret;
+
+  w = MPOOL_NEW(tc, struct wide);
+  ret = th_check(w && (uintptr_t) w % 64 == 0, "MPOOL_NEW keeps a type's alignment (%p)", w) && ret;
+
+  mpool_tcache_free(tc, w);
+  mpool_tcache_free(tc, n[2]);
+  mpool_tcache_free(tc, n[1]);
+  mpool_tcache_free(tc, n[0]);
+  mpool_tcache_destroy(tc);
+  ret = th_check(p->alloc_list->first == NULL, "every block went back to the pool") && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_slab() {
+  struct memory_pool *p;
+  struct mpool_slab *s;
+  char *obj[1000];
+  char *again;
+  int i, j;
+  int ret = 1;
+
+  p = mpool_create(1 << 16);
+
+  if(!(ret = th_check(p != NULL, "mpool_create returned non-null (%p)", p)))
+	return 0;
+
+  s = mpool_slab_create(p, 24, 8);
+  ret = th_check(s != NULL, "mpool_slab_create returned non-null (%p)", s) && ret;
+
+  for(i = 0; ret && i < 1000; i++) {
+	obj[i] = mpool_slab_alloc(s);
+	ret = th_check(obj[i] != NULL, "mpool_slab_alloc (%p) #%d is non-null", obj[i], i) && ret;
+	ret = ret && th_check(obj[i] >= p->start && obj[i] + 24 <= p->start + p->size, "slab object (%p) is inside pool", obj[i]);
+	ret = ret && th_check((uintptr_t) obj[i] % 8 == 0, "slab object (%p) is aligned to 8", obj[i]);
+	if(ret) memset(obj[i], i, 24);
+  }
+
+  for(i = 0; ret && i < 1000; i++)
+	for(j = 0; j < 24; j++)
+	  if(obj[i][j] != (char) i)
+		ret = th_check(0, "slab object #%d was not overwritten by another", i);
+
+  for(i = 0; ret && i < 1000; i++)
+	mpool_slab_free(s, obj[i]);
+
+  if(ret) {
+	again = mpool_slab_alloc(s);
+	ret = th_check(again == obj[999], "mpool_slab_alloc reuses the last freed slot (%p)", again) && ret;
+	mpool_slab_free(s, again);
+  }
+
+  if(s) mpool_slab_destroy(s);
+  ret = ret && th_check(p->alloc_list->first == NULL, "mpool_slab_destroy returned its pages to the pool");
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_realloc(enum mpool_policy policy) {
+  struct mpool_opts opts = { policy };
+  struct memory_pool *p;
+  char *a, *b, *c, *r;
+  int i;
+  int ret = 1;
+
+  p = mpool_create_opts(8192, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (policy %d) returned non-null (%p)", policy, p)))
+	return 0;
+
+  a = mpool_alloc(p, 100);
+  b = mpool_alloc(p, 100);
+  c = mpool_alloc(p, 1000);
+  for(i = 0; i < 100; i++)
+	a[i] = i;
+  mpool_free(p, b);
+
+  r = mpool_realloc(p, a, 200);
+  ret = th_check(r == a, "mpool_realloc grows (%p) into the free neighbour in place (%p)", a, r) && ret;
+
+  r = mpool_realloc(p, a, 40);
+  ret = th_check(r == a, "mpool_realloc shrinks (%p) in place (%p)", a, r) && ret;
+
+  b = mpool_alloc(p, 64);
+  ret = th_check(b != NULL && b < c, "the shrunk tail is reused (%p)", b) && ret;
+
+  r = mpool_realloc(p, a, 3000);
+  ret = th_check(r != NULL && r != a, "mpool_realloc moves (%p) when its neighbour is in use (%p)", a, r) && ret;
+  for(i = 0; ret && i < 40; i++)
+	if(r[i] != i) ret = th_check(0, "mpool_realloc kept byte %d", i);
+
+  ret = th_check(mpool_realloc(p, NULL, 10) != NULL, "mpool_realloc of NULL allocates") && ret;
+  ret = th_check(mpool_realloc(p, r, 0) == NULL, "mpool_realloc to zero bytes frees") && ret;
+
+  // Growing over all of a free neighbour leaves nothing of it to hand out
+  mpool_destroy(p);
+  p = mpool_create_opts(8192, &opts);
+  a = mpool_alloc(p, 96);
+  b = mpool_alloc(p, 96);
+  c = mpool_alloc(p, 96);
+  mpool_free(p, b);
+  r = mpool_realloc(p, a, 190);
+  ret = th_check(r == a, "mpool_realloc (%p) takes in the whole free neighbour (%p)", a, r) && ret;
+  b = mpool_alloc(p, 96);
+  ret = th_check(b != NULL && (b >= a + 190 || b + 96 <= a), "the neighbour is not handed out again (%p)", b) && ret;
+
+  r = mpool_realloc(p, a, SIZE_MAX);
+  ret = th_check(r == NULL && mpool_usable_size(p, a) >= 190, "mpool_realloc to SIZE_MAX fails and keeps the block (%p)", r) && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_batch(enum mpool_policy policy) {
+  struct mpool_opts opts = { policy };
+  struct memory_pool *p;
+  struct alloc_info *ai;
+  void *objs[300];
+  void *tmp;
+  int i, j, n;
+  int ret = 1;
+
+  p = mpool_create_opts(1 << 16, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (policy %d) returned non-null (%p)", policy, p)))
+	return 0;
+
+  n = mpool_alloc_batch(p, 40, 300, objs);
+  ret = th_check(n == 300, "mpool_alloc_batch allocated all 300 blocks (%d)", n) && ret;
+
+  for(i = 0; ret && i < n; i++) {
+	ret = th_check((uintptr_t) objs[i] % 16 == 0, "batch block %p is aligned to 16", objs[i]) && ret;
+	memset(objs[i], i, 40);
+  }
+  for(i = 0; ret && i < n; i++)
+	for(j = 0; j < 40; j++)
+	  if(((char *) objs[i])[j] != (char) i)
+		ret = th_check(0, "batch block #%d does not overlap another", i);
+
+  /* free in a scrambled order, with neighbours in the same batch */
+  srand(2);
+  for(i = n - 1; i > 0; i--) {
+	j = rand() % (i + 1);
+	tmp = objs[i]; objs[i] = objs[j]; objs[j] = tmp;
+  }
+  mpool_free_batch(p, objs, n / 2);
+  ret = th_check(objs[0] != NULL, "mpool_free_batch leaves the caller's array alone") && ret;
+  mpool_free_batch(p, objs + n / 2, n - n / 2);
+
+  ret = ret && th_check(p->alloc_list->first == NULL, "alloc_list is empty after the batch frees");
+  ret = ret && th_check(p->free_list->first == p->free_list->last, "free_list has a single block after the batch frees");
+  if(ret) {
+	ai = p->free_list->first->user_data;
+	ret = th_check(ai->offset == 0 && ai->size == p->size, "free block covers the pool (offset %lu, size %lu)", ai->offset, ai->size) && ret;
+  }
+
+  n = mpool_alloc_batch(p, (size_t) 1 << 62, 4, objs);
+  ret = th_check(n == 0, "a batch whose total size wraps is refused (%d)", n) && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_lazy_commit(unsigned flags) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, flags };
+  struct memory_pool *p;
+  char *a, *b;
+  int ret = 1;
+
+  p = mpool_create_opts((size_t) 4 << 30, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts of 4 GiB (flags %u) returned non-null (%p)", flags, p)))
+	return 0;
+
+  ret = th_check(p->arenas->committed == 0, "nothing is committed before the first allocation (%lu)", p->arenas->committed) && ret;
+
+  a = mpool_alloc(p, 100);
+  ret = ret && th_check(a != NULL, "mpool_alloc (%p) for sz 100 is non-null", a);
+  ret = ret && th_check(p->arenas->committed >= 100 && p->arenas->committed <= (4 << 20), "first allocation commits a small chunk (%lu)", p->arenas->committed);
+  if(ret) memset(a, 1, 100);
+
+  b = mpool_alloc(p, 10 << 20);
+  ret = ret && th_check(b != NULL, "mpool_alloc (%p) for sz %lu is non-null", b, 10 << 20);
+  ret = ret && th_check(p->arenas->committed >= (size_t) (b - p->start) + (10 << 20), "committed memory (%lu) covers the new high-water mark", p->arenas->committed);
+  if(ret) memset(b, 1, 10 << 20);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_grow(enum mpool_policy policy) {
+  struct mpool_opts opts = { policy, MPOOL_GROW, 1 << 16 };
+  struct memory_pool *p;
+  struct mpool_arena *arena;
+  struct llnode *n;
+  char *alloc[100];
+  int i, narenas = 0, nfree = 0, nalloc;
+  int ret = 1;
+
+  p = mpool_create_opts(4096, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (policy %d) returned non-null (%p)", policy, p)))
+	return 0;
+
+  for(i = 0; i < 100; i++) {
+	alloc[i] = mpool_alloc(p, 1000);
+	if(!alloc[i]) break;
+	memset(alloc[i], i, 1000);
+  }
+  nalloc = i;
+
+  for(arena = p->arenas; arena; arena = arena->next)
+	narenas++;
+  ret = th_check(nalloc > 4 && narenas > 1, "the pool grew past its first arena (%d allocations, %d arenas)", nalloc, narenas) && ret;
+  ret = th_check(nalloc < 100 && p->total_size <= (1 << 16), "growth stopped at the cap (%lu bytes)", p->total_size) && ret;
+
+  for(i = 0; ret && i < nalloc; i++) {
+	if(alloc[i][0] != (char) i || alloc[i][999] != (char) i)
+	  ret = th_check(0, "allocation #%d was not overwritten", i);
+	mpool_free(p, alloc[i]);
+  }
+
+  ret = ret && th_check(p->alloc_list->first == NULL, "every allocation was freed from its own arena");
+
+  for(n = p->free_list->first; n; n = n->next)
+	nfree++;
+  if(policy != MPOOL_BUDDY)
+	ret = ret && th_check(nfree == narenas, "each arena is a single free block again (%d blocks)", nfree);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_arena(void) {
+  struct mpool_opts opts = { MPOOL_ARENA, MPOOL_GROW, 1 << 16 };
+  struct memory_pool *p;
+  char *a, *b, *c;
+  int ret = 1;
+
+  p = mpool_create_opts(4096, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (arena) returned non-null (%p)", p)))
+	return 0;
+
+  a = mpool_alloc(p, 10);
+  b = mpool_alloc(p, 24);
+  ret = th_check(a == p->start && b == a + 16, "allocations are bumped in order (%p, %p)", a, b) && ret;
+  ret = th_check((uintptr_t) b % 8 == 0, "bumped allocation is aligned (%p)", b) && ret;
+
+  memset(b, 'b', 24);
+  mpool_free(p, b);
+  c = mpool_realloc(p, b, 100);
+  ret = th_check(c == b && c[23] == 'b', "the last allocation grows in place (%p)", c) && ret;
+  c = mpool_realloc(p, a, 200);
+  ret = th_check(c != a && c != NULL, "other allocations move on realloc (%p)", c) && ret;
+
+  c = mpool_alloc(p, 8000);
+  ret = th_check(c != NULL && p->arenas->next != NULL, "a full arena moves on to a new one (%p)", c) && ret;
+
+  mpool_reset(p);
+  a = mpool_alloc(p, 100);
+  ret = th_check(a == p->start, "reset rewinds to the start of the pool (%p)", a) && ret;
+
+  mpool_destroy(p);
+
+  p = mpool_create(1024);
+  a = mpool_alloc(p, 512);
+  b = mpool_alloc(p, 512);
+  mpool_reset(p);
+  ret = th_check(p->alloc_list->first == NULL && p->free_list->first != NULL
+				 && p->free_list->first == p->free_list->last, "reset leaves one free block") && ret;
+  a = mpool_alloc(p, 1024);
+  ret = th_check(a == p->start, "the whole pool is allocatable after reset (%p)", a) && ret;
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_stats(void) {
+  struct memory_pool *p;
+  struct mpool_stats s;
+  char *a, *b, *c, line[128];
+  FILE *dump;
+  int found = 0;
+  int ret = 1;
+
+  p = mpool_create(4096);
+
+  if(!(ret = th_check(p != NULL, "mpool_create returned non-null (%p)", p)))
+	return 0;
+
+  a = mpool_alloc(p, 100);
+  b = mpool_alloc(p, 1000);
+  c = mpool_alloc(p, 100);
+  mpool_free(p, b);
+  b = mpool_realloc(p, a, 150);
+  mpool_alloc(p, 8192);
+  mpool_stats(p, &s);
+
+  ret = th_check(s.allocs == 3 && s.frees == 1 && s.failures == 1,
+				 "counters (%lu allocs, %lu frees, %lu failures)", s.allocs, s.frees, s.failures) && ret;
+  ret = th_check(s.in_use + s.free == s.total && s.in_use >= 250,
+				 "in use (%lu) and free (%lu) bytes add up to the pool (%lu)", s.in_use, s.free, s.total) && ret;
+  ret = th_check(s.high_water >= 1200, "high-water mark covers the peak (%lu)", s.high_water) && ret;
+  ret = th_check(s.free_blocks == 2 && s.largest_free < s.free && s.fragmentation > 0,
+				 "free space is split in %lu blocks (fragmentation %.3f)", s.free_blocks, s.fragmentation) && ret;
+  ret = th_check(s.size_hist[7] == 2 && s.size_hist[10] == 1, "allocations are counted by size class") && ret;
+
+  dump = tmpfile();
+  mpool_stats_print(p, dump);
+  rewind(dump);
+  while(fgets(line, sizeof(line), dump))
+	if(!strcmp(line, "mpool_allocs_total 3\n"))
+	  found = 1;
+  fclose(dump);
+  ret = th_check(found, "the text dump lists the counters") && ret;
+
+  mpool_free(p, b);
+  mpool_free(p, c);
+  mpool_stats(p, &s);
+  ret = th_check(s.in_use == 0 && s.free_blocks == 1 && s.fragmentation == 0,
+				 "an empty pool has nothing in use (%lu)", s.in_use) && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* in a child, store to addr[at]; returns whether the child crashed
+   with a guard report containing `expect` */
+static int guard_crash(char *addr, size_t at, const char *expect) {
+  char buf[512] = {0};
+  int fds[2], status;
+  size_t len;
+  ssize_t n;
+  pid_t pid;
+
+  if(pipe(fds))
+	return 0;
+  fflush(stdout);
+  pid = fork();
+  if(pid == 0) {
+	dup2(fds[1], 2);
+	((volatile char *) addr)[at] = 1;
+	_exit(0);
+  }
+  close(fds[1]);
+  for(len = 0; len < sizeof(buf) - 1 && (n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0; len += n)
+	;
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  return strstr(buf, expect) && !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int test_guard(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GUARD, 0, 1 };
+  struct memory_pool *p;
+  struct mpool_stats s;
+  size_t page = sysconf(_SC_PAGESIZE);
+  char *a, *b, *big;
+  int ret = 1;
+
+  p = mpool_create_opts(1 << 20, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (guard) returned non-null (%p)", p)))
+	return 0;
+
+  a = mpool_alloc(p, 48);
+  ret = th_check(a && ((uintptr_t) a + 48) % page == 0 && (a < p->start || a >= p->start + p->size),
+				 "a sampled block ends at a guard page (%p)", a) && ret;
+  ret = th_check(mpool_usable_size(p, a) == 48, "usable size of a guarded block") && ret;
+  memset(a, 1, 48);
+  ret = th_check(guard_crash(a, 48, "overflow of 48-byte guarded block"), "overflow faults with a report") && ret;
+
+  big = mpool_alloc(p, 2 * page);
+  ret = th_check(big >= p->start && big < p->start + p->size, "blocks over a page come from the pool") && ret;
+
+  b = mpool_realloc(p, a, 100);
+  ret = th_check(b && b[0] == 1 && b[47] == 1, "realloc moves a guarded block with its contents") && ret;
+  ret = th_check(guard_crash(a, 0, "use-after-free of 48-byte guarded block"), "use after free faults with a report") && ret;
+
+  mpool_free(p, b);
+  mpool_free(p, big);
+  mpool_stats(p, &s);
+  ret = th_check(s.in_use == 0, "guarded blocks are counted in the stats (%lu in use)", s.in_use) && ret;
+
+  mpool_destroy(p);
+
+  // Arena pools sample too, and every way of freeing returns the slot
+  opts.policy = MPOOL_ARENA;
+  p = mpool_create_opts(1 << 20, &opts);
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (arena, guard) returned non-null (%p)", p) && ret))
+	return 0;
+  a = mpool_alloc(p, 48);
+  memset(a, 2, 48);
+  b = mpool_realloc(p, a, 100);
+  ret = th_check(b && b != a && b[0] == 2 && b[47] == 2, "realloc moves a guarded block out of an arena pool") && ret;
+  ret = th_check(guard_crash(a, 0, "use-after-free of 48-byte guarded block"), "the arena pool's guarded block was freed") && ret;
+  a = mpool_alloc(p, 48);
+  mpool_free_batch(p, (void **) &a, 1);
+  ret = th_check(guard_crash(a, 0, "use-after-free of 48-byte guarded block"), "mpool_free_batch frees a guarded block in an arena pool") && ret;
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_purge(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, 0, 0, 0, 5 };
+  struct memory_pool *p;
+  struct mpool_stats s;
+  struct timespec tick = { 0, 1000000 };
+  size_t big = 2 << 20, bytes;
+  char *a, *b;
+  int i;
+  int ret = 1;
+
+  p = mpool_create_opts(4 << 20, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (decay) returned non-null (%p)", p)))
+	return 0;
+
+  a = mpool_alloc(p, big);
+  memset(a, 0x5a, big);
+  mpool_free(p, a);
+  bytes = mpool_purge(p);
+  mpool_stats(p, &s);
+  ret = th_check(bytes >= big && s.purged == bytes, "mpool_purge releases the freed pages (%lu bytes)", bytes) && ret;
+  ret = th_check(mpool_purge(p) == 0, "purged pages are not released twice") && ret;
+
+  b = mpool_alloc(p, big);
+  ret = th_check(b == a && b[0] == 0 && b[big - 1] == 0, "purged memory comes back as zero pages") && ret;
+  memset(b, 0x5a, big);
+
+  ret = th_check(mpool_maintain_start(p, 1), "maintenance thread started") && ret;
+  mpool_free(p, b);
+  for(i = 0; i < 1000; i++) {
+	mpool_stats(p, &s);
+	if(s.purged >= bytes + big)
+	  break;
+	nanosleep(&tick, NULL);
+  }
+  ret = th_check(s.purged >= bytes + big, "idle free pages decay back to the system (%lu bytes)", s.purged) && ret;
+  mpool_maintain_stop(p);
+
+  // Only the pages a small block touches are dirty again once it is freed
+  bytes = 0;
+  for(i = 0; i < 6; i++) {
+	a = mpool_alloc(p, 100);
+	memset(a, 0x5a, 100);
+	mpool_free(p, a);
+	bytes += mpool_purge(p);
+  }
+  ret = th_check(bytes <= 6 * 4096, "reusing the front of a purged block purges only its pages (%lu bytes)", bytes) && ret;
+
+  a = mpool_alloc(p, 4 << 20);
+  memset(a, 0x5a, 4 << 20);
+  mpool_reset(p);
+  bytes = mpool_purge(p);
+  ret = th_check(bytes >= (4 << 20) - 4096, "memory touched before mpool_reset can still be purged (%lu bytes)", bytes) && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+/* a list kept in a file-backed pool, linked by offsets */
+struct file_node {
+  size_t next;
+  int value;
+};
+
+int test_file(void) {
+  char path[64];
+  struct memory_pool *p;
+  struct file_node *n;
+  struct mpool_stats s;
+  size_t off = 0, in_use;
+  int i, count = 0, sum = 0, status;
+  int ret = 1;
+  pid_t pid;
+  void *old, *hold, *obj;
+  size_t *offs, page = sysconf(_SC_PAGESIZE);
+  struct stat st;
+  off_t created;
+
+  snprintf(path, sizeof(path), "/tmp/pa_test_file.%d", (int) getpid());
+  unlink(path);
+  p = mpool_open_file(path, 1 << 20);
+
+  if(!(ret = th_check(p != NULL, "mpool_open_file created a pool (%p)", p)))
+	return 0;
+
+  for(i = 0; i < 100; i++) {
+	n = mpool_alloc(p, sizeof(*n));
+	n->value = i;
+	n->next = off;
+	off = mpool_off(p, n);
+  }
+  mpool_set_root(p, mpool_ptr(p, off));
+  mpool_stats(p, &s);
+  in_use = s.in_use;
+  mpool_destroy(p);
+
+  // Keep the old address taken, so the file has to map elsewhere
+  old = (void *) ((uintptr_t) p & ~(uintptr_t) (page - 1));
+  hold = mmap(old, page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  p = mpool_open_file(path, 0);
+  if(!(ret = th_check(p != NULL, "mpool_open_file reopened the pool (%p)", p)))
+	return 0;
+  ret = th_check(hold == old && (void *) p != old, "the pool moved from %p to %p", old, p) && ret;
+  mpool_stats(p, &s);
+  ret = th_check(s.in_use == in_use, "the pool's blocks survived (%lu bytes in use)", s.in_use) && ret;
+  for(n = mpool_root(p); n; n = mpool_ptr(p, off)) {
+	count++;
+	sum += n->value;
+	off = n->next;
+	mpool_free(p, n);
+  }
+  ret = th_check(count == 100 && sum == 4950, "the list survived (%d nodes)", count) && ret;
+  ret = th_check(p->alloc_list->first == NULL && p->free_list->first == p->free_list->last,
+				 "the reopened pool frees and merges its blocks") && ret;
+  mpool_destroy(p);
+  munmap(hold, page);
+  unlink(path);
+
+  // The bookkeeping starts small and grows to a 16-byte block for every
+  // 16 bytes of the pool
+  p = mpool_open_file(path, 1 << 20);
+  stat(path, &st);
+  created = st.st_size;
+  ret = th_check(created <= 3 << 20, "a new 1 MiB file pool takes %ld bytes", (long) created) && ret;
+  offs = malloc(65536 * sizeof(size_t));
+  for(i = 0; i < 65536 && (obj = mpool_alloc(p, 16)); i++)
+	offs[i] = mpool_off(p, obj);
+  ret = th_check(i == 65536, "a 1 MiB file pool holds %d 16-byte blocks", i) && ret;
+  stat(path, &st);
+  ret = th_check(st.st_size > created, "its file grew to %ld bytes", (long) st.st_size) && ret;
+  mpool_destroy(p);
+  p = mpool_open_file(path, 0);
+  for(count = 0; count < i && p && mpool_usable_size(p, mpool_ptr(p, offs[count])) == 16; count++)
+	;
+  ret = th_check(count == i, "the pool knows its %d blocks again", count) && ret;
+  if(p) {
+	for(count = 0; count < i; count++)
+	  mpool_free(p, mpool_ptr(p, offs[count]));
+	ret = th_check(p->alloc_list->first == NULL && p->free_list->first == p->free_list->last,
+				   "and frees and merges them") && ret;
+	mpool_destroy(p);
+  }
+  free(offs);
+
+  // A process that dies with the pool open leaves the file unusable
+  fflush(stdout);
+  pid = fork();
+  if(pid == 0) {
+	mpool_open_file(path, 0);
+	_exit(0);
+  }
+  waitpid(pid, &status, 0);
+  p = mpool_open_file(path, 0);
+  ret = th_check(p == NULL, "a pool that was left open is refused") && ret;
+  unlink(path);
+
+  return ret;
+}
+
+int test_trace(void) {
+  struct memory_pool *p;
+  struct mpool_trace_rec rec[8];
+  char *a, *b, *c, magic[8];
+  const char *path = "pa_test.trace";
+  FILE *f;
+  size_t n = 0;
+  int ret = 1;
+
+  p = mpool_create(4096);
+
+  if(!(ret = th_check(p != NULL, "mpool_create returned non-null (%p)", p)))
+	return 0;
+
+  a = mpool_alloc(p, 10);
+  ret = th_check(mpool_trace_start(p, path), "trace started") && ret;
+  b = mpool_alloc(p, 100);
+  c = mpool_alloc(p, 200);
+  mpool_free(p, a);
+  b = mpool_realloc(p, b, 300);
+  mpool_free(p, c);
+  mpool_trace_stop(p);
+  mpool_free(p, b);
+  mpool_destroy(p);
+
+  f = fopen(path, "rb");
+  if(f) {
+	if(fread(magic, 8, 1, f) == 1 && !memcmp(magic, MPOOL_TRACE_MAGIC, 8))
+	  n = fread(rec, sizeof(rec[0]), 8, f);
+	fclose(f);
+  }
+  remove(path);
+
+  ret = th_check(n == 4, "trace holds the 4 calls on blocks allocated while tracing (%lu)", n) && ret;
+  if(!ret)
+	return 0;
+  ret = th_check(rec[0].op == MPOOL_TRACE_ALLOC && rec[0].size == 100 && rec[0].id == 0
+				 && rec[1].op == MPOOL_TRACE_ALLOC && rec[1].size == 200 && rec[1].id == 1,
+				 "allocations are numbered in order") && ret;
+  ret = th_check(rec[2].op == MPOOL_TRACE_REALLOC && rec[2].id == 0 && rec[2].size == 300,
+				 "realloc keeps the allocation's id") && ret;
+  ret = th_check(rec[3].op == MPOOL_TRACE_FREE && rec[3].id == 1, "free names the allocation") && ret;
+  ret = th_check(rec[0].time_ns <= rec[3].time_ns, "timestamps are in order") && ret;
+
+  return ret;
+}
+
+int test_aligned(enum mpool_policy policy) {
+  struct mpool_opts opts = { policy, 0, 0 };
+  struct memory_pool *p;
+  char *a, *b, *c, *d;
+  size_t align;
+  int ret = 1;
+
+  p = mpool_create_opts(16384, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (policy %d) returned non-null (%p)", policy, p)))
+	return 0;
+
+  for(align = 32; align <= 4096; align *= 2) {
+	a = mpool_alloc_aligned(p, 100, align);
+	ret = th_check(a && (uintptr_t) a % align == 0, "mpool_alloc_aligned (%p) is aligned to %lu", a, align) && ret;
+	mpool_free(p, a);
+  }
+  ret = th_check(mpool_alloc_aligned(p, 100, 48) == NULL, "alignment must be a power of two") && ret;
+
+  a = mpool_alloc(p, 8);
+  b = mpool_alloc_aligned(p, 64, 4096);
+  c = mpool_alloc(p, 1000);
+  ret = th_check(b && (uintptr_t) b % 4096 == 0, "page-aligned allocation (%p)", b) && ret;
+  if(policy != MPOOL_BUDDY)
+	ret = th_check(c > a && c < b, "the padding before it is reused (%p < %p < %p)", a, c, b) && ret;
+
+  d = mpool_alloc_aligned(p, 4096, 4096);
+  ret = th_check(d && (uintptr_t) d % 4096 == 0, "page-sized page-aligned allocation (%p)", d) && ret;
+  mpool_free(p, a);
+  mpool_free(p, b);
+  mpool_free(p, c);
+  mpool_free(p, d);
+  ret = th_check(p->alloc_list->first == NULL && p->free_list->first == p->free_list->last,
+				 "everything merges back into one free block") && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_small(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_GROW | MPOOL_SMALL, 0 };
+  struct memory_pool *p;
+  struct mpool_stats s;
+  struct llnode *n;
+  char *alloc[1000], *q;
+  int i, j, nrecords = 0;
+  int ret = 1;
+
+  p = mpool_create_opts(1 << 16, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (small) returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; i < 1000; i++) {
+	alloc[i] = mpool_alloc(p, 1 + i % 200);
+	if(!alloc[i] || (1 + i % 200 > 8 && (uintptr_t) alloc[i] % 16)) {
+	  ret = th_check(0, "small allocation #%d (%p) is aligned", i, alloc[i]);
+	  break;
+	}
+	memset(alloc[i], i, 1 + i % 200);
+  }
+  for(n = p->alloc_list->first; n; n = n->next)
+	nrecords++;
+  ret = th_check(nrecords <= 2 * MPOOL_SMALL_CLASSES, "1000 small blocks use %d pool blocks", nrecords) && ret;
+  ret = th_check(mpool_usable_size(p, alloc[23]) == 32, "a 24-byte request gets a 32-byte slot (%lu)",
+				 mpool_usable_size(p, alloc[23])) && ret;
+
+  for(i = 0; ret && i < 1000; i++)
+	for(j = 0; j < 1 + i % 200; j++)
+	  if(alloc[i][j] != (char) i) {
+		ret = th_check(0, "small allocation #%d was not overwritten", i);
+		break;
+	  }
+
+  q = mpool_realloc(p, alloc[23], 30);
+  ret = th_check(q == alloc[23], "realloc within the slot stays put") && ret;
+  q = mpool_realloc(p, q, 1000);
+  ret = th_check(q != alloc[23] && q[23] == 23, "realloc past the slot moves the contents") && ret;
+  alloc[23] = q;
+
+  for(i = 0; i < 1000; i++)
+	mpool_free(p, alloc[i]);
+  mpool_stats(p, &s);
+  ret = th_check(s.allocs == s.frees && s.allocs >= 1001, "small blocks are counted (%lu allocs, %lu frees)",
+				 s.allocs, s.frees) && ret;
+
+  nrecords = 0;
+  for(n = p->alloc_list->first; n; n = n->next)
+	nrecords++;
+  ret = th_check(nrecords <= MPOOL_SMALL_CLASSES, "emptied runs go back to the pool (%d left)", nrecords) && ret;
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
+int test_defer(void) {
+  struct mpool_opts opts = { MPOOL_SEGREGATED, MPOOL_DEFER, 0 };
+  struct memory_pool *p;
+  struct mpool_stats s;
+  struct timespec tick = { 0, 1000000 };
+  char *alloc[4];
+  int i;
+  int ret = 1;
+
+  p = mpool_create_opts(4096, &opts);
+
+  if(!(ret = th_check(p != NULL, "mpool_create_opts (defer) returned non-null (%p)", p)))
+	return 0;
+
+  for(i = 0; i < 4; i++)
+	alloc[i] = mpool_alloc(p, 1024);
+  for(i = 0; i < 4; i++)
+	mpool_free(p, alloc[i]);
+  mpool_stats(p, &s);
+  ret = th_check(p->free_list->first == NULL && s.deferred == 4096, "frees are queued, not merged (%lu bytes)",
+				 s.deferred) && ret;
+
+  alloc[0] = mpool_alloc(p, 4096);
+  ret = th_check(alloc[0] == p->start, "a miss merges the queued frees (%p)", alloc[0]) && ret;
+  mpool_free(p, alloc[0]);
+  mpool_coalesce(p);
+  ret = th_check(p->free_list->first && p->free_list->first == p->free_list->last,
+				 "mpool_coalesce leaves one free block") && ret;
+
+  ret = th_check(mpool_maintain_start(p, 1), "maintenance thread started") && ret;
+  for(i = 0; i < 4; i++)
+	alloc[i] = mpool_alloc(p, 1024);
+  for(i = 0; i < 4; i++)
+	mpool_free(p, alloc[i]);
+  for(i = 0; i < 1000; i++) {
+	pthread_mutex_lock(&p->lock);
+	if(!p->ndeferred)
+	  break;
+	pthread_mutex_unlock(&p->lock);
+	nanosleep(&tick, NULL);
+  }
+  if(i == 1000)
+	pthread_mutex_lock(&p->lock);
+  ret = th_check(p->ndeferred == 0 && p->free_list->first && p->free_list->first == p->free_list->last,
+				 "the maintenance thread merged the frees") && ret;
+  pthread_mutex_unlock(&p->lock);
+  mpool_maintain_stop(p);
+
+  mpool_destroy(p);
+
+  return ret;
+}
+
 int main(int argc, char *argv[]) {
   int poolsize = 1024;
 
@@ -105,6 +1273,105 @@ int main(int argc, char *argv[]) {
   if(!test_alloc_free(poolsize))
 	exit(1);
 
+  if(!test_size_classes())
+	exit(1);
+
+  if(!test_too_large())
+	exit(1);
+
+  if(!test_free_coalesce(MPOOL_SEGREGATED))
+	exit(1);
+
+  if(!test_free_coalesce(MPOOL_BESTFIT))
+	exit(1);
+
+  if(!test_bestfit())
+	exit(1);
+
+  if(!test_free_coalesce(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_buddy())
+	exit(1);
+
+  if(!test_tcache())
+	exit(1);
+
+  if(!test_tcache_remote())
+	exit(1);
+
+  if(!test_tcache_new())
+	exit(1);
+
+  if(!test_slab())
+	exit(1);
+
+  if(!test_realloc(MPOOL_SEGREGATED))
+	exit(1);
+
+  if(!test_realloc(MPOOL_BESTFIT))
+	exit(1);
+
+  if(!test_realloc(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_batch(MPOOL_SEGREGATED))
+	exit(1);
+
+  if(!test_batch(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_aligned(MPOOL_SEGREGATED))
+	exit(1);
+
+  if(!test_aligned(MPOOL_BESTFIT))
+	exit(1);
+
+  if(!test_aligned(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_small())
+	exit(1);
+
+  if(!test_defer())
+	exit(1);
+
+  if(!test_guard())
+	exit(1);
+
+  if(!test_purge())
+	exit(1);
+
+  if(!test_file())
+	exit(1);
+
+  if(!test_lazy_commit(0))
+	exit(1);
+
+  if(!test_grow(MPOOL_SEGREGATED))
+	exit(1);
+
+  if(!test_grow(MPOOL_BESTFIT))
+	exit(1);
+
+  if(!test_grow(MPOOL_BUDDY))
+	exit(1);
+
+  if(!test_arena())
+	exit(1);
+
+  if(!test_stats())
+	exit(1);
+
+  if(!test_trace())
+	exit(1);
+
+  if(!test_lazy_commit(MPOOL_HUGE_THP))
+	exit(1);
+
+  if(!test_lazy_commit(MPOOL_HUGE_EXPLICIT))
+	exit(1);
+
   printf("ALL DONE\n");
   return 0;
 }
@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <string.h>
+#include <time.h>
+#include "dbll.h"
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   allocation traces
+
+   While a trace is running every mpool_alloc, mpool_free and
+   mpool_realloc appends a struct mpool_trace_rec to the trace file,
+   after an MPOOL_TRACE_MAGIC header. Allocations are numbered in the
+   order they are made; a table of live addresses gives frees and
+   reallocs the number of the allocation they refer to. Records are
+   written under the pool lock, so the file is in the order the pool
+   saw the calls.
+ */
+
+#define IDS_MIN_CAP 1024
+
+struct mpool_trace {
+    FILE *out;
+    struct timespec t0;
+    uint32_t next_id;
+    struct trace_id *ids;       /* open-addressed table of live addresses */
+    size_t cap, count;
+};
+
+struct trace_id {
+    uintptr_t addr;
+    uint32_t id;
+};
+
+static size_t id_hash(struct mpool_trace *t, uintptr_t addr)
+{
+    return (size_t) ((addr * 0x9E3779B97F4A7C15ULL) >> 17) & (t->cap - 1);
+}
+
+static void id_put(struct mpool_trace *t, uintptr_t addr, uint32_t id)
+{
+    size_t i;
+
+    for (i = id_hash(t, addr); t->ids[i].addr; i = (i + 1) & (t->cap - 1))
+        ;
+    t->ids[i].addr = addr;
+    t->ids[i].id = id;
+    t->count++;
+}
+
+static int id_grow(struct mpool_trace *t)
+{
+    struct trace_id *old = t->ids;
+    size_t old_cap = t->cap, i;
+
+    t->cap = old_cap ? old_cap * 2 : IDS_MIN_CAP;
+    t->ids = os_map(t->cap * sizeof(struct trace_id));
+    if (!t->ids) {
+        t->ids = old;
+        t->cap = old_cap;
+        return 0;
+    }
+    t->count = 0;
+    for (i = 0; i < old_cap; i++)
+        if (old[i].addr) id_put(t, old[i].addr, old[i].id);
+    os_unmap(old, old_cap * sizeof(struct trace_id));
+    return 1;
+}
+
+/* remove `addr` from the table; returns 0 if it was not there */
+static int id_take(struct mpool_trace *t, uintptr_t addr, uint32_t *id)
+{
+    size_t i, j, home;
+
+    if (!t->cap) return 0;
+    for (i = id_hash(t, addr); t->ids[i].addr != addr; i = (i + 1) & (t->cap - 1))
+        if (!t->ids[i].addr) return 0;
+    *id = t->ids[i].id;
+
+    // Backward-shift the rest of the cluster into the hole
+    for (j = (i + 1) & (t->cap - 1); t->ids[j].addr; j = (j + 1) & (t->cap - 1)) {
+        home = id_hash(t, t->ids[j].addr);
+        if (((j - home) & (t->cap - 1)) >= ((j - i) & (t->cap - 1))) {
+            t->ids[i] = t->ids[j];
+            i = j;
+        }
+    }
+    t->ids[i].addr = 0;
+    t->count--;
+    return 1;
+}
+
+static void trace_write(struct mpool_trace *t, unsigned op, uint32_t id, size_t size)
+{
+    struct mpool_trace_rec rec;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec.time_ns = (uint64_t) (now.tv_sec - t->t0.tv_sec) * 1000000000 + now.tv_nsec - t->t0.tv_nsec;
+    rec.size = size;
+    rec.id = id;
+    rec.op = op;
+    fwrite(&rec, sizeof(rec), 1, t->out);
+}
+
+void trace_alloc(struct memory_pool *p, void *addr, size_t size)
+{
+    struct mpool_trace *t = p->trace;
+
+    if (!addr) return;
+    if ((t->count + 1) * 2 > t->cap && !id_grow(t))
+        return;
+    id_put(t, (uintptr_t) addr, t->next_id);
+    trace_write(t, MPOOL_TRACE_ALLOC, t->next_id++, size);
+}
+
+void trace_free(struct memory_pool *p, void *addr)
+{
+    uint32_t id;
+
+    if (id_take(p->trace, (uintptr_t) addr, &id))
+        trace_write(p->trace, MPOOL_TRACE_FREE, id, 0);
+}
+
+void trace_realloc(struct memory_pool *p, void *addr, void *moved, size_t size)
+{
+    struct mpool_trace *t = p->trace;
+    uint32_t id;
+
+    if (!moved || !id_take(t, (uintptr_t) addr, &id))
+        return;
+    id_put(t, (uintptr_t) moved, id);
+    trace_write(t, MPOOL_TRACE_REALLOC, id, size);
+}
+
+/* start recording the pool's allocations to the file at `path`;
+   returns 0 if the file cannot be written */
+int mpool_trace_start(struct memory_pool *p, const char *path)
+{
+    struct mpool_trace *t = os_map(sizeof(struct mpool_trace));
+
+    if (!t) return 0;
+    t->out = fopen(path, "wb");
+    // A trace that is never closed is still a trace, if an empty one
+    if (!t->out || fwrite(MPOOL_TRACE_MAGIC, 8, 1, t->out) != 1 || fflush(t->out)) {
+        if (t->out) fclose(t->out);
+        os_unmap(t, sizeof(struct mpool_trace));
+        POOL_ERROR("ERROR: cannot write trace to %s\n", path);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t->t0);
+
+    pthread_mutex_lock(&p->lock);
+    if (p->trace) trace_close(p->trace);
+    p->trace = t;
+    pthread_mutex_unlock(&p->lock);
+    return 1;
+}
+
+void mpool_trace_stop(struct memory_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->trace) trace_close(p->trace);
+    p->trace = NULL;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void trace_close(struct mpool_trace *t)
+{
+    fclose(t->out);
+    os_unmap(t->ids, t->cap * sizeof(struct trace_id));
+    os_unmap(t, sizeof(struct mpool_trace));
+}
+
+/* close a trace that was inherited through fork() without writing out
+   what the parent had buffered: the file offset is shared with the
+   parent, which writes those records itself */
+void trace_discard(struct mpool_trace *t)
+{
+    __fpurge(t->out);
+    trace_close(t);
+}
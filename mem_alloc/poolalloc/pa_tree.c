@@ -0,0 +1,127 @@
+#include <stddef.h>
+#include "poolalloc.h"
+#include "pa_internal.h"
+
+/*
+   AVL tree of free blocks ordered by (size, address), used by the
+   best-fit policy. The links live in the blocks themselves. Offsets
+   are only unique within an arena, so the key is the block's address.
+ */
+
+static int height(struct alloc_info *t)
+{
+    return t ? t->height : 0;
+}
+
+static int key_less(struct alloc_info *a, struct alloc_info *b)
+{
+    return a->size < b->size || (a->size == b->size && block_addr(a) < block_addr(b));
+}
+
+static void update(struct alloc_info *t)
+{
+    int l = height(t->left), r = height(t->right);
+    t->height = 1 + (l > r ? l : r);
+}
+
+static struct alloc_info *rotate_right(struct alloc_info *y)
+{
+    struct alloc_info *x = y->left;
+
+    y->left = x->right;
+    x->right = y;
+    update(y);
+    update(x);
+    return x;
+}
+
+static struct alloc_info *rotate_left(struct alloc_info *x)
+{
+    struct alloc_info *y = x->right;
+
+    x->right = y->left;
+    y->left = x;
+    update(x);
+    update(y);
+    return y;
+}
+
+static struct alloc_info *balance(struct alloc_info *t)
+{
+    int bf;
+
+    update(t);
+    bf = height(t->left) - height(t->right);
+    if (bf > 1) {
+        if (height(t->left->left) < height(t->left->right))
+            t->left = rotate_left(t->left);
+        return rotate_right(t);
+    }
+    if (bf < -1) {
+        if (height(t->right->right) < height(t->right->left))
+            t->right = rotate_right(t->right);
+        return rotate_left(t);
+    }
+    return t;
+}
+
+/* insert `block` into the tree rooted at `t`, returning the new root */
+struct alloc_info *tree_insert(struct alloc_info *t, struct alloc_info *block)
+{
+    if (!t) {
+        block->left = block->right = NULL;
+        block->height = 1;
+        return block;
+    }
+    if (key_less(block, t))
+        t->left = tree_insert(t->left, block);
+    else
+        t->right = tree_insert(t->right, block);
+    return balance(t);
+}
+
+static struct alloc_info *remove_min(struct alloc_info *t, struct alloc_info **min)
+{
+    if (!t->left) {
+        *min = t;
+        return t->right;
+    }
+    t->left = remove_min(t->left, min);
+    return balance(t);
+}
+
+/* remove `block` (with the key it was inserted under), returning the new root */
+struct alloc_info *tree_remove(struct alloc_info *t, struct alloc_info *block)
+{
+    struct alloc_info *min, *right;
+
+    if (!t) return NULL;
+    if (t == block) {
+        if (!t->right) return t->left;
+        right = remove_min(t->right, &min);
+        min->left = t->left;
+        min->right = right;
+        return balance(min);
+    }
+    if (key_less(block, t))
+        t->left = tree_remove(t->left, block);
+    else
+        t->right = tree_remove(t->right, block);
+    return balance(t);
+}
+
+/* smallest block whose key is at least (size, addr), or NULL */
+struct alloc_info *tree_lower_bound(struct alloc_info *t, size_t size, uintptr_t addr)
+{
+    struct alloc_info *best = NULL;
+
+    while (t) {
+        if (t->size > size || (t->size == size && block_addr(t) >= addr)) {
+            best = t;
+            t = t->left;
+        }
+        else
+            t = t->right;
+    }
+    return best;
+}
@@ -1,59 +1,331 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "dbll.h"
 #include "poolalloc.h"
+#include "pa_internal.h"
+
+void print_node(struct llnode *node);
 
 #define CHECK(item) \
     do { if (!item) return NULL; } while(0)
 
-void dbll_destroy_node(struct llnode *node)
+/* size class of a free block of `size` bytes */
+static unsigned size_class(size_t size)
+{
+    unsigned fl;
+
+    if (size < 64)
+        return size >> 3;
+    fl = 63 - __builtin_clzll(size);
+    return 8 + (fl - 6) * 4 + ((size >> (fl - 2)) & 3);
+}
+
+/* smallest block size that falls into class `c` */
+static size_t class_min(unsigned c)
+{
+    unsigned fl, sl;
+
+    if (c < 8)
+        return (size_t) c << 3;
+    fl = (c - 8) / 4 + 6;
+    sl = (c - 8) % 4;
+    return ((size_t) 4 + sl) << (fl - 2);
+}
+
+/* bin of a free block: its size class, or its order in a buddy pool */
+static unsigned block_bin(struct memory_pool *p, struct alloc_info *block)
+{
+    if (p->policy == MPOOL_BUDDY)
+        return 63 - __builtin_clzll(block->size);
+    return size_class(block->size);
+}
+
+static void bin_insert(struct memory_pool *p, struct alloc_info *block)
+{
+    unsigned c = block_bin(p, block);
+
+    block->bin_prev = NULL;
+    block->bin_next = p->bins[c];
+    if (p->bins[c])
+        p->bins[c]->bin_prev = block;
+    p->bins[c] = block;
+    p->bin_map[c / 64] |= 1ULL << (c % 64);
+}
+
+static void bin_remove(struct memory_pool *p, struct alloc_info *block)
+{
+    unsigned c = block_bin(p, block);
+
+    if (block->bin_prev)
+        block->bin_prev->bin_next = block->bin_next;
+    else
+        p->bins[c] = block->bin_next;
+    if (block->bin_next)
+        block->bin_next->bin_prev = block->bin_prev;
+    if (!p->bins[c])
+        p->bin_map[c / 64] &= ~(1ULL << (c % 64));
+}
+
+/* first non-empty bin at or above class `c`, or -1 */
+int find_bin(struct memory_pool *p, unsigned c)
 {
-    if (!node) return;
-    free(node->user_data);
-    dbll_destroy_node(node->next);
-    free(node);
+    unsigned w = c / 64;
+    uint64_t bits;
+
+    if (c >= MPOOL_NBINS)
+        return -1;
+    bits = p->bin_map[w] & (~0ULL << (c % 64));
+    while (!bits) {
+        if (++w == MPOOL_BIN_WORDS)
+            return -1;
+        bits = p->bin_map[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
 }
-void dbll_destroy(struct dbll *list)
+
+/* add a free block to the pool's free-block index */
+void free_insert(struct memory_pool *p, struct alloc_info *block)
 {
-    if (list->first)
-        dbll_destroy_node(list->first);
-    free(list);
+    if (p->policy == MPOOL_BESTFIT)
+        p->tree = tree_insert(p->tree, block);
+    else
+        bin_insert(p, block);
 }
 
-struct alloc_info *block_create(size_t offset, size_t size, size_t req_size)
+void free_remove(struct memory_pool *p, struct alloc_info *block)
 {
-    struct alloc_info *block = calloc(sizeof(struct alloc_info), 1);
-    CHECK(block);
+    if (p->policy == MPOOL_BESTFIT)
+        p->tree = tree_remove(p->tree, block);
+    else
+        bin_remove(p, block);
+}
 
-    block->offset = offset;
-    block->size = size;
-    block->request_size = req_size;
+/*
+   boundary tags: every block knows its physical neighbours through
+   prev/next, and the tag table maps the address handed out by
+   mpool_alloc back to its block, so mpool_free never searches a list.
+   The tags are kept beside the pool rather than in it so that a pool of
+   N bytes can still hand out all N bytes.
+ */
+
+#define TAG_MIN_CAP 64
+
+static size_t tag_hash(struct memory_pool *p, uintptr_t addr)
+{
+    return (size_t) ((addr * 0x9E3779B97F4A7C15ULL) >> 17) & (p->tag_cap - 1);
+}
+
+static int tag_grow(struct memory_pool *p)
+{
+    struct mpool_tag *old = p->tags;
+    size_t old_cap = p->tag_cap;
+    size_t i, j;
+
+    p->tag_cap = old_cap ? old_cap * 2 : TAG_MIN_CAP;
+    p->tags = meta_map(p, p->tag_cap * sizeof(struct mpool_tag));
+    if (!p->tags) {
+        p->tags = old;
+        p->tag_cap = old_cap;
+        return 0;
+    }
+    for (i = 0; i < old_cap; i++) {
+        if (!old[i].addr) continue;
+        for (j = tag_hash(p, old[i].addr); p->tags[j].addr; j = (j + 1) & (p->tag_cap - 1))
+            ;
+        p->tags[j] = old[i];
+    }
+    meta_unmap(p, old, old_cap * sizeof(struct mpool_tag));
+    return 1;
+}
+
+static int tag_insert(struct memory_pool *p, void *addr, struct alloc_info *block)
+{
+    size_t i;
 
+    if ((p->tag_count + 1) * 2 > p->tag_cap && !tag_grow(p))
+        return 0;
+    for (i = tag_hash(p, (uintptr_t) addr); p->tags[i].addr; i = (i + 1) & (p->tag_cap - 1))
+        ;
+    p->tags[i].addr = (uintptr_t) addr;
+    p->tags[i].block = block;
+    p->tag_count++;
+    return 1;
+}
+
+static size_t tag_slot(struct memory_pool *p, void *addr)
+{
+    size_t i;
+
+    for (i = tag_hash(p, (uintptr_t) addr); p->tags[i].addr != (uintptr_t) addr; i = (i + 1) & (p->tag_cap - 1)) {
+        if (!p->tags[i].addr) return p->tag_cap;
+    }
+    return i;
+}
+
+/* block that was handed out at `addr`, or NULL */
+struct alloc_info *pool_find(struct memory_pool *p, void *addr)
+{
+    size_t i;
+
+    if (!p->tag_cap) return NULL;
+    i = tag_slot(p, addr);
+    return i == p->tag_cap ? NULL : p->tags[i].block;
+}
+
+/* remove and return the block that was handed out at `addr`, or NULL */
+static struct alloc_info *tag_remove(struct memory_pool *p, void *addr)
+{
+    size_t mask = p->tag_cap - 1;
+    size_t i, j, home;
+    struct alloc_info *block;
+
+    if (!p->tag_cap) return NULL;
+    i = tag_slot(p, addr);
+    if (i == p->tag_cap) return NULL;
+    block = p->tags[i].block;
+    p->tag_count--;
+
+    /* shift later entries of the probe run back into the hole */
+    for (j = (i + 1) & mask; p->tags[j].addr; j = (j + 1) & mask) {
+        home = tag_hash(p, p->tags[j].addr);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            p->tags[i] = p->tags[j];
+            i = j;
+        }
+    }
+    p->tags[i].addr = 0;
+    p->tags[i].block = NULL;
     return block;
 }
 
+/* refill the tag table from alloc_list, once every address in it has
+   moved (pa_file.c) */
+void tag_rebuild(struct memory_pool *p)
+{
+    struct llnode *node;
+    struct alloc_info *block;
+
+    if (!p->tag_cap) return;
+    memset(p->tags, 0, p->tag_cap * sizeof(struct mpool_tag));
+    p->tag_count = 0;
+    for (node = p->alloc_list->first; node; node = node->next) {
+        block = node->user_data;
+        tag_insert(p, (void *) (block_addr(block) + block->pad), block);
+    }
+}
+
 /*
    a pool-based allocator that uses doubly-linked lists to track
    allocated and free blocks
  */
 
 /* create and initialize a memory pool of the required size */
-/* use malloc() or calloc() to obtain this initial pool of memory from the system */
+/* the pool's memory is reserved up front and committed as it is used */
 struct memory_pool *mpool_create(size_t size)
 {
+    return mpool_create_opts(size, NULL);
+}
+
+/* make all of an arena's memory available for allocation */
+static int arena_init(struct memory_pool *p, struct mpool_arena *arena)
+{
+    struct alloc_info *init_block;
+
+    if (p->policy == MPOOL_ARENA)
+        return 1;
+    if (p->policy == MPOOL_BUDDY)
+        return buddy_init(p, arena);
+
+    init_block = block_create(p, arena, 0, arena->size, 0);
+    if (!init_block) return 0;
+    init_block->is_free = 1;
+    init_block->node = list_append(p->free_list, init_block);
+    free_insert(p, init_block);
+    // Only memory that was committed can have been touched
+    dirty_add(p, init_block, 0, arena->committed);
+    return 1;
+}
+
+/* add `arena`, whose fields are filled in, to the pool and its memory
+   to the free blocks */
+struct mpool_arena *arena_link(struct memory_pool *p, struct mpool_arena *arena)
+{
+    struct mpool_arena **tail;
+
+    for (tail = &p->arenas; *tail; tail = &(*tail)->next)
+        ;
+    *tail = arena;
+    p->total_size += arena->size;
+
+    return arena_init(p, arena) ? arena : NULL;
+}
+
+/* reserve a new arena of `size` bytes and add its memory to the free blocks */
+static struct mpool_arena *arena_add(struct memory_pool *p, size_t size)
+{
+    struct mpool_arena *arena;
+
+    arena = meta_map(p, sizeof(struct mpool_arena));
+    CHECK(arena);
+    arena->start = os_reserve(size, p->flags, &arena->reserved);
+    if (!arena->start) {
+        meta_unmap(p, arena, sizeof(struct mpool_arena));
+        return NULL;
+    }
+    arena->size = size;
+
+    return arena_link(p, arena);
+}
+
+/* add an arena big enough for `need` bytes, at least doubling the last
+   one, without going over the pool's growth cap */
+static int pool_grow(struct memory_pool *p, size_t need)
+{
+    struct mpool_arena *last;
+    size_t size;
+
+    for (last = p->arenas; last->next; last = last->next)
+        ;
+    size = last->size * 2;
+    if (size < need)
+        size = need;
+    if (p->policy == MPOOL_BUDDY)
+        size = (size_t) 1 << (64 - __builtin_clzll(size - 1));
+
+    if (p->max_size) {
+        if (p->total_size >= p->max_size)
+            return 0;
+        if (size > p->max_size - p->total_size)
+            size = p->max_size - p->total_size;
+        if (size < need)
+            return 0;
+    }
+    return arena_add(p, size) != NULL;
+}
 
-    /* set start to memory obtained from malloc */
-    struct memory_pool *pool = calloc(sizeof(struct memory_pool), 1);
+/* create a pool with non-default options; opts may be NULL */
+struct memory_pool *mpool_create_opts(size_t size, const struct mpool_opts *opts)
+{
+    // The pool takes nothing from the system heap, so it can back malloc itself
+    struct memory_pool *pool = os_map(sizeof(struct memory_pool));
     CHECK(pool);
-    pool->start = calloc(size, 1);
-    CHECK(pool->start);
+    pool->flags = opts ? opts->flags : 0;
+    pool->max_size = opts ? opts->max_size : 0;
+    pool->policy = opts ? opts->policy : MPOOL_SEGREGATED;
+    pool->decay_ms = opts ? opts->decay_ms : 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->alloc_list = &pool->alloc_head;
+    pool->free_list = &pool->free_head;
 
+    if (!arena_add(pool, size) ||
+        ((pool->flags & MPOOL_GUARD) && !guard_init(pool, opts->guard_rate))) {
+        mpool_destroy(pool);
+        return NULL;
+    }
+    pool->start = pool->arenas->start;
     pool->size = size;
-    pool->alloc_list = dbll_create();
-    pool->free_list = dbll_create();
-
-    struct alloc_info *init_block = block_create(0, size, 0);
-    dbll_append(pool->free_list, init_block);
+    pool->bump_arena = pool->arenas;
 
     return pool;
 }
@@ -62,11 +334,60 @@ struct memory_pool *mpool_create(size_t size)
 /* this includes the alloc_list and the free_list as well */
 void mpool_destroy(struct memory_pool *p)
 {
-    free(p->start);
+    struct mpool_arena *arena, *next;
+
+    mpool_maintain_stop(p);
+    if (p->trace) trace_close(p->trace);
+    if (p->guard) guard_close(p);
+    // A file-backed pool stays in its file for the next mpool_open_file
+    if (p->file) {
+        file_close(p);
+        return;
+    }
+
+    for (arena = p->arenas; arena; arena = next) {
+        next = arena->next;
+        os_release(arena->start, arena->reserved);
+        os_unmap(arena, sizeof(struct mpool_arena));
+    }
+    meta_release_all(p);
+    os_unmap(p->tags, p->tag_cap * sizeof(struct mpool_tag));
+    pthread_mutex_destroy(&p->lock);
+    os_unmap(p, sizeof(struct memory_pool));
+}
+
+/* Release every allocation in the pool at once. An arena pool only
+   rewinds its bump pointer; other pools drop all of their blocks and
+   start over with each arena as free memory. No tcache or slab may
+   still hold blocks of the pool */
+void mpool_reset(struct memory_pool *p)
+{
+    struct mpool_arena *arena;
 
-    dbll_destroy(p->alloc_list);
-    dbll_destroy(p->free_list);
-    free(p);
+    pthread_mutex_lock(&p->lock);
+    p->bump_arena = p->arenas;
+    p->bump = 0;
+    p->last = NULL;
+    p->in_use = 0;
+    if (p->guard) guard_reset(p);
+
+    if (p->policy != MPOOL_ARENA) {
+        meta_release_all(p);
+        p->alloc_head = p->free_head = (struct dbll) { NULL, NULL };
+        memset(p->bins, 0, sizeof(p->bins));
+        memset(p->small, 0, sizeof(p->small));
+        p->deferred = NULL;
+        p->ndeferred = 0;
+        memset(p->bin_map, 0, sizeof(p->bin_map));
+        p->tree = NULL;
+        p->dirty_first = p->dirty_last = NULL;
+        if (p->tags)
+            memset(p->tags, 0, p->tag_cap * sizeof(struct mpool_tag));
+        p->tag_count = 0;
+        for (arena = p->arenas; arena; arena = arena->next)
+            arena_init(p, arena);
+    }
+    pthread_mutex_unlock(&p->lock);
 }
 
 size_t calc_align(size_t size)
@@ -96,6 +417,76 @@ size_t align_address(size_t align, size_t offset)
     return offset;
 }
 
+/* padding needed to align the start of `block` */
+static size_t block_pad(struct alloc_info *block, size_t align)
+{
+    uintptr_t addr = block_addr(block);
+    return align_address(align, addr) - addr;
+}
+
+static int block_fits(struct memory_pool *p, struct alloc_info *block, size_t size, size_t align)
+{
+    return block->size >= size + block_pad(block, align);
+}
+
+/* find a free block that can hold `size` bytes at alignment `align` */
+/* every block in a class at or above the one holding size + align - 1
+   fits, so the head of the first such bin is taken in O(1). Below that
+   are the one or two classes that may or may not fit: their heads are
+   tried first so a freed block is reused by a request of the same size,
+   and they are only searched in full when nothing larger is free */
+static struct alloc_info *find_segregated(struct memory_pool *p, size_t size, size_t align)
+{
+    size_t worst = size + align - 1;
+    unsigned lo = size_class(size);
+    unsigned c = size_class(worst);
+    int bin;
+    struct alloc_info *block;
+
+    if (class_min(c) < worst)
+        c++;
+
+    for (bin = lo; bin < c; bin++) {
+        block = p->bins[bin];
+        if (block && block_fits(p, block, size, align))
+            return block;
+    }
+
+    bin = find_bin(p, c);
+    if (bin >= 0)
+        return p->bins[bin];
+
+    for (bin = find_bin(p, lo); bin >= 0 && bin < c; bin = find_bin(p, bin + 1)) {
+        for (block = p->bins[bin]; block; block = block->bin_next) {
+            if (block_fits(p, block, size, align))
+                return block;
+        }
+    }
+    return NULL;
+}
+
+/* smallest free block that can hold `size` bytes at alignment `align` */
+/* blocks of at least size + align - 1 bytes always fit; only the
+   smaller ones in between depend on where they start */
+static struct alloc_info *find_best(struct memory_pool *p, size_t size, size_t align)
+{
+    struct alloc_info *block = tree_lower_bound(p->tree, size, 0);
+
+    while (block && block->size < size + align - 1) {
+        if (block_fits(p, block, size, align))
+            return block;
+        block = tree_lower_bound(p->tree, block->size, block_addr(block) + 1);
+    }
+    return block;
+}
+
+static struct alloc_info *find_free(struct memory_pool *p, size_t size, size_t align)
+{
+    if (p->policy == MPOOL_BESTFIT)
+        return find_best(p, size, align);
+    return find_segregated(p, size, align);
+}
+
 /* allocate a chunk of memory out of the free pool */
 /* Return NULL if there is not enough memory in the free pool */
 /* The address you return must be aligned to 1 (for size=1), 2 (for
@@ -104,105 +495,672 @@ size_t align_address(size_t align, size_t offset)
 */
 void *mpool_alloc(struct memory_pool *p, size_t size)
 {
+    void *addr;
+
     if (!size) return NULL; // cannot allocate nothing
 
-    struct llnode *node = p->free_list->first;
-    int align = calc_align(size);
-    int found = 0;
-    int padding;
-    int aligned_address;
-    struct alloc_info *block;
-    while (node) {
-        block = (struct alloc_info *)node->user_data;
-        aligned_address = align_address(align, block->offset);
-        padding = aligned_address - block->offset;
-        if (block->size >= size+padding) {
-            found = 1;
+    pthread_mutex_lock(&p->lock);
+    addr = guard_sample(p) ? guard_alloc(p, size, calc_align(size), __builtin_return_address(0)) : NULL;
+    if (!addr) addr = pool_alloc(p, size, calc_align(size));
+    if (p->trace) trace_alloc(p, addr, size);
+    pthread_mutex_unlock(&p->lock);
+    return addr;
+}
+
+/* arena mode: bump the pointer past `size` bytes at alignment `align`,
+   moving on to the next arena (or adding one) when the current is full */
+static void *bump_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+    struct mpool_arena *arena;
+    size_t offset;
+
+    for (;;) {
+        arena = p->bump_arena;
+        offset = align_address(align, (uintptr_t) (arena->start + p->bump)) - (uintptr_t) arena->start;
+        if (offset + size <= arena->size) {
+            if (!os_commit(arena->start, &arena->committed, offset + size, arena->reserved, p->flags))
+                break;
+            stat_alloc(p, size, offset + size - p->bump);
+            p->bump = offset + size;
+            p->last = arena->start + offset;
+            return p->last;
+        }
+
+        if (arena->next) {
+            p->bump_arena = arena->next;
+            p->bump = 0;
+        }
+        else if (!(p->flags & MPOOL_GROW) || !pool_grow(p, size + align))
             break;
+    }
+    POOL_ERROR("ERROR: failed to allocate %lu bytes: out of memory\n", size);
+    return NULL;
+}
+
+#define MIN_SPLIT 16
+
+static void *block_alloc(struct memory_pool *p, size_t size, size_t align);
+static void free_block(struct memory_pool *p, struct alloc_info *block);
+
+/* whether MPOOL_SMALL serves this request */
+static int small_fits(struct memory_pool *p, size_t size, size_t align)
+{
+    return (p->flags & MPOOL_SMALL) && size <= MPOOL_SMALL_MAX && align <= calc_align(size);
+}
+
+/* mpool_alloc with an explicit alignment; the caller holds p->lock */
+void *pool_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+    void *addr;
+
+    // Finding and carving a block adds up to `align` to the size
+    if (size > PTRDIFF_MAX || align > PTRDIFF_MAX - size) {
+        POOL_ERROR("ERROR: failed to allocate %lu bytes: too large\n", size);
+        p->nfail++;
+        return NULL;
+    }
+
+    if (p->policy == MPOOL_ARENA)
+        addr = bump_alloc(p, size, align);
+    else if (small_fits(p, size, align))
+        addr = small_alloc(p, size);
+    else
+        addr = block_alloc(p, size, align);
+    if (!addr) p->nfail++;
+    return addr;
+}
+
+/* split the free `block` after its first `keep` bytes and return the
+   second half, also free */
+static struct alloc_info *split_free(struct memory_pool *p, struct alloc_info *block, size_t keep)
+{
+    struct alloc_info *rest;
+
+    rest = block_create(p, block->arena, block->offset + keep, block->size - keep, 0);
+    if (!rest) return NULL;
+    rest->is_free = 1;
+    dirty_split(p, block, rest);
+    rest->prev = block;
+    rest->next = block->next;
+    if (block->next) block->next->prev = rest;
+    block->next = rest;
+
+    free_remove(p, block);
+    block->size = keep;
+    free_insert(p, block);
+    rest->node = list_append(p->free_list, rest);
+    free_insert(p, rest);
+    return rest;
+}
+
+/* take a block for `size` bytes at alignment `align` from the free blocks */
+static void *block_alloc(struct memory_pool *p, size_t size, size_t align)
+{
+    struct alloc_info *block;
+
+    for (;;) {
+        if (p->policy == MPOOL_BUDDY)
+            block = buddy_find(p, size, align);
+        else
+            block = find_free(p, size, align);
+        if (block) break;
+
+        // Queued frees may merge into a fit before the pool has to grow
+        if (p->deferred) {
+            pool_coalesce(p, (size_t) -1);
+            continue;
         }
-        node = node->next;
+        if (!(p->flags & MPOOL_GROW) || !pool_grow(p, size + align)) {
+            POOL_ERROR("ERROR: failed to allocate %lu bytes: out of memory\n", size);
+            return NULL;
+        }
+    }
+
+    struct mpool_arena *arena = block->arena;
+    size_t offset = block->offset;
+    size_t padding = block_pad(block, align);
+    struct alloc_info *alloc_block = block;
+    char *addr = arena->start + offset + padding;
+
+    size_t used = size + padding;
+
+    // Buddy blocks are handed out whole
+    if (p->policy == MPOOL_BUDDY)
+        used = block->size;
+
+    // Commit memory up to the end of the block on first use
+    if (!os_commit(arena->start, &arena->committed, offset + used, arena->reserved, p->flags)) {
+        POOL_ERROR("ERROR: failed to commit %lu bytes of pool memory\n", offset + used);
+        return NULL;
+    }
+
+    // Padding worth a block of its own stays free for later allocations
+    if (p->policy != MPOOL_BUDDY && padding >= MIN_SPLIT) {
+        block = split_free(p, block, padding);
+        if (!block) return NULL;
+        alloc_block = block;
+        offset = block->offset;
+        used = size;
+        padding = 0;
     }
-    if (!found) {
-        printf("ERROR: failed to allocate %d bytes: out of memory\n", size);
+
+    if (block->size > used) {
+        // Carve the front of the block off as a new allocated block
+        alloc_block = block_create(p, arena, offset, used, size);
+        if (!alloc_block) return NULL;
+    }
+    if (!tag_insert(p, addr, alloc_block)) {
+        if (alloc_block != block) block_release(p, alloc_block);
         return NULL;
     }
 
-    // If we used up the entire block, remove it from the free list
-    if (block->size == size+padding) {
-        dbll_remove(p->free_list, node);
-        free(block);
+    free_remove(p, block);
+    if (alloc_block == block) {
+        // We used up the entire block, remove it from the free list
+        list_remove(p->free_list, block->node);
+        dirty_remove(p, block);
+        block->is_free = 0;
+        block->request_size = size;
     }
     else {
         // Else, just shrink the free_list block
-        block->size -= size+padding;
-        block->offset += size+padding;
+        block->size -= used;
+        block->offset += used;
+        free_insert(p, block);
+
+        alloc_block->prev = block->prev;
+        alloc_block->next = block;
+        if (block->prev) block->prev->next = alloc_block;
+        block->prev = alloc_block;
     }
 
     // Add the new block to the alloc_list
-    struct alloc_info *alloc_block = block_create(aligned_address, size+padding, size);
-    dbll_append(p->alloc_list, alloc_block);
-    return p->start+aligned_address;
+    alloc_block->pad = padding;
+    alloc_block->node = list_append(p->alloc_list, alloc_block);
+    stat_alloc(p, size, alloc_block->size);
+    return addr;
+}
+
+/* absorb the physically following block `next` into `block` */
+static void merge_next(struct memory_pool *p, struct alloc_info *block, struct alloc_info *next)
+{
+    block->size += next->size;
+    block->next = next->next;
+    if (next->next) next->next->prev = block;
+
+    free_remove(p, next);
+    list_remove(p->free_list, next->node);
+    if (block->is_free)
+        dirty_absorb(p, block, next);
+    block_release(p, next);
 }
 
 /* Free a chunk of memory out of the pool */
-/* This moves the chunk of memory to the free list. */
-/* You may want to coalesce free blocks [i.e. combine two free blocks
-   that are are next to each other in the pool into one larger free
-   block. Note this requires that you keep the list of free blocks in order */
+/* This moves the chunk of memory to the free list and merges it with
+   whichever of its physical neighbours are free, so free blocks are
+   never adjacent to each other */
 void mpool_free(struct memory_pool *p, void *addr)
 {
-    /* search the alloc_list for the block */
-    /* move it to the free_list */
-    /* coalesce the free_list */
-    struct llnode *node = p->alloc_list->first;
+    pthread_mutex_lock(&p->lock);
+    if (p->trace) trace_free(p, addr);
+    if (!(p->flags & MPOOL_GUARD) || !guard_free(p, addr, __builtin_return_address(0)))
+        pool_free(p, addr);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* mpool_free for a caller that holds p->lock */
+void pool_free(struct memory_pool *p, void *addr)
+{
     struct alloc_info *block;
-    int found = 0;
-    while (node) {
-        block = (struct alloc_info *) node->user_data;
-        if (addr == &p->start[block->offset]) {
-            found = 1;
-            break;
+
+    // Guarded blocks go back to their slots under every policy
+    if ((p->flags & MPOOL_GUARD) && guard_free(p, addr, NULL))
+        return;
+    // Arena pools only give memory back through mpool_reset
+    if (p->policy == MPOOL_ARENA) return;
+
+    block = tag_remove(p, addr);
+
+    if (!block) {
+        if ((p->flags & MPOOL_SMALL) && small_free(p, addr))
+            return;
+        POOL_ERROR("ERROR: cannot free unallocated address\n");
+        return;
+    }
+
+    // Move block from allocated to free
+    stat_free(p, block->size);
+    list_remove(p->alloc_list, block->node);
+    block->node = NULL;
+    block->request_size = 0;
+    block->pad = 0;
+
+    // Leave the merging to pool_coalesce
+    if ((p->flags & MPOOL_DEFER) && p->policy != MPOOL_BUDDY) {
+        block->bin_next = p->deferred;
+        p->deferred = block;
+        p->ndeferred++;
+        return;
+    }
+    free_block(p, block);
+}
+
+/* make `block`, which is on no list, free: merge it with whichever of
+   its physical neighbours are free, so free blocks are never adjacent */
+static void free_block(struct memory_pool *p, struct alloc_info *block)
+{
+    block->is_free = 1;
+    dirty_add(p, block, block->offset, block->offset + block->size);
+
+    if (p->policy == MPOOL_BUDDY) {
+        block = buddy_merge(p, block);
+        block->node = list_append(p->free_list, block);
+        free_insert(p, block);
+        return;
+    }
+
+    if (block->next && block->next->is_free)
+        merge_next(p, block, block->next);
+
+    if (block->prev && block->prev->is_free) {
+        struct alloc_info *prev = block->prev;
+
+        free_remove(p, prev);
+        prev->size += block->size;
+        prev->next = block->next;
+        dirty_absorb(p, prev, block);
+        if (block->next) block->next->prev = prev;
+        free_insert(p, prev);
+        block_release(p, block);
+        return;
+    }
+
+    block->node = list_append(p->free_list, block);
+    free_insert(p, block);
+}
+
+/* merge up to `max` of the frees MPOOL_DEFER queued into the free
+   blocks; returns how many are still queued */
+size_t pool_coalesce(struct memory_pool *p, size_t max)
+{
+    struct alloc_info *block;
+
+    for (; p->deferred && max; max--) {
+        block = p->deferred;
+        p->deferred = block->bin_next;
+        p->ndeferred--;
+        free_block(p, block);
+    }
+    return p->ndeferred;
+}
+
+/* merge every queued free of an MPOOL_DEFER pool now */
+void mpool_coalesce(struct memory_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    pool_coalesce(p, (size_t) -1);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* shrink `block` to `keep` bytes and return the rest of it to the free
+   blocks, merging it with a free successor */
+static void split_tail(struct memory_pool *p, struct alloc_info *block, size_t keep)
+{
+    struct alloc_info *tail;
+
+    tail = block_create(p, block->arena, block->offset + keep, block->size - keep, 0);
+    if (!tail) return;
+    tail->is_free = 1;
+    dirty_add(p, tail, tail->offset, tail->offset + tail->size);
+    tail->prev = block;
+    tail->next = block->next;
+    if (block->next) block->next->prev = tail;
+    block->next = tail;
+    block->size = keep;
+
+    if (tail->next && tail->next->is_free)
+        merge_next(p, tail, tail->next);
+    tail->node = list_append(p->free_list, tail);
+    free_insert(p, tail);
+}
+
+/* grow or shrink `block` in place to hold `size` bytes after its
+   padding; returns 0 if that needs memory it cannot get */
+static int resize_in_place(struct memory_pool *p, struct alloc_info *block, size_t size)
+{
+    struct alloc_info *next = block->next;
+    size_t want = block->pad + size;
+    size_t extra;
+
+    if (p->policy == MPOOL_BUDDY)
+        return buddy_resize(p, block, size);
+
+    if (want <= block->size) {
+        if (block->size - want >= MIN_SPLIT)
+            split_tail(p, block, want);
+        return 1;
+    }
+
+    // Take the missing bytes from the front of a free successor
+    extra = want - block->size;
+    if (!next || !next->is_free || next->size < extra)
+        return 0;
+    if (!os_commit(block->arena->start, &block->arena->committed, block->offset + want,
+                block->arena->reserved, p->flags))
+        return 0;
+
+    if (next->size - extra < MIN_SPLIT) {
+        merge_next(p, block, next);
+        return 1;
+    }
+    free_remove(p, next);
+    next->offset += extra;
+    next->size -= extra;
+    free_insert(p, next);
+    block->size += extra;
+    return 1;
+}
+
+/* arena mode realloc: the most recent allocation grows or shrinks in
+   place; anything else is copied as far as its arena was handed out,
+   since its old size is not recorded */
+static void *bump_realloc(struct memory_pool *p, void *addr, size_t size)
+{
+    struct mpool_arena *arena = p->bump_arena;
+    size_t offset, avail = 0;
+    void *moved;
+
+    if (addr == p->last) {
+        offset = (char *) addr - arena->start;
+        if (offset + size <= arena->size
+                && os_commit(arena->start, &arena->committed, offset + size, arena->reserved, p->flags)) {
+            p->in_use = p->in_use - p->bump + offset + size;
+            if (p->in_use > p->high_water)
+                p->high_water = p->in_use;
+            p->bump = offset + size;
+            return addr;
         }
-        node = node->next;
     }
 
-    if (!found) {
-        printf("ERROR: cannot free unallocated address\n");
+    for (arena = p->arenas; arena; arena = arena->next) {
+        if ((char *) addr < arena->start || (char *) addr >= arena->start + arena->size)
+            continue;
+        // earlier arenas were handed out up to their committed end
+        avail = (arena == p->bump_arena ? p->bump : arena->committed) - ((char *) addr - arena->start);
+        break;
+    }
+    if (!arena) {
+        POOL_ERROR("ERROR: cannot realloc unallocated address\n");
+        return NULL;
+    }
+
+    moved = bump_alloc(p, size, calc_align(size));
+    if (moved)
+        memcpy(moved, addr, avail < size ? avail : size);
+    return moved;
+}
+
+/* mpool_realloc of the allocation at `addr`, held in `block` */
+static void *block_realloc(struct memory_pool *p, struct alloc_info *block, void *addr, size_t size)
+{
+    size_t old_size = block->size;
+    void *moved;
+
+    if ((uintptr_t) addr % calc_align(size) == 0 && resize_in_place(p, block, size)) {
+        block->request_size = size;
+        p->in_use = p->in_use - old_size + block->size;
+        if (p->in_use > p->high_water)
+            p->high_water = p->in_use;
+        return addr;
+    }
+
+    moved = pool_alloc(p, size, calc_align(size));
+    if (moved) {
+        memcpy(moved, addr, block->request_size < size ? block->request_size : size);
+        pool_free(p, addr);
+    }
+    return moved;
+}
+
+/* resize the allocation at `addr` to `size` bytes, keeping its contents */
+/* the block is grown into a free neighbour or shrunk in place whenever
+   possible; otherwise it moves. Like realloc(), a NULL addr allocates and
+   a zero size frees */
+void *mpool_realloc(struct memory_pool *p, void *addr, size_t size)
+{
+    struct alloc_info *block;
+    size_t old_size;
+    void *moved = NULL;
+
+    if (!addr) return mpool_alloc(p, size);
+    if (!size) {
+        mpool_free(p, addr);
+        return NULL;
+    }
+    // Resizing in place adds the block's padding to the size
+    if (size > PTRDIFF_MAX) {
+        POOL_ERROR("ERROR: failed to allocate %lu bytes: too large\n", size);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if ((p->flags & MPOOL_GUARD) && (old_size = guard_size(p, addr))) {
+        // Only fresh allocations are sampled, so the block moves out
+        if ((moved = pool_alloc(p, size, calc_align(size)))) {
+            memcpy(moved, addr, old_size < size ? old_size : size);
+            guard_free(p, addr, __builtin_return_address(0));
+        }
+    }
+    else if (p->policy == MPOOL_ARENA)
+        moved = bump_realloc(p, addr, size);
+    else if ((block = pool_find(p, addr)))
+        moved = block_realloc(p, block, addr, size);
+    else if ((p->flags & MPOOL_SMALL) && (old_size = small_size(p, addr))) {
+        // A slot stays put while the new size fits in it
+        moved = addr;
+        if (size > old_size && (moved = pool_alloc(p, size, calc_align(size)))) {
+            memcpy(moved, addr, old_size);
+            small_free(p, addr);
+        }
+    }
+    else
+        POOL_ERROR("ERROR: cannot realloc unallocated address\n");
+    if (p->trace) trace_realloc(p, addr, moved, size);
+    pthread_mutex_unlock(&p->lock);
+    return moved;
+}
+
+/* Allocate `size` bytes at an address that is a multiple of `align`,
+   which must be a power of two. Padding needed to reach the alignment
+   is left free for other allocations when it is large enough to hold
+   one. A later mpool_realloc only keeps the alignment mpool_alloc would
+   give the new size. */
+void *mpool_alloc_aligned(struct memory_pool *p, size_t size, size_t align)
+{
+    void *addr;
+
+    if (!size) return NULL;
+    if (!align || (align & (align - 1))) {
+        POOL_ERROR("ERROR: alignment %lu is not a power of two\n", align);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    addr = guard_sample(p) ? guard_alloc(p, size, align, __builtin_return_address(0)) : NULL;
+    if (!addr) addr = pool_alloc(p, size, align);
+    if (p->trace) trace_alloc(p, addr, size);
+    pthread_mutex_unlock(&p->lock);
+    return addr;
+}
+
+/* bytes usable at `addr`, which must have come from mpool_alloc or
+   mpool_realloc; 0 if the pool did not hand it out or keeps no record
+   of it (arena pools) */
+size_t mpool_usable_size(struct memory_pool *p, void *addr)
+{
+    struct alloc_info *block;
+    size_t size = 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->policy != MPOOL_ARENA && (block = pool_find(p, addr)))
+        size = block->size - block->pad;
+    else if (p->flags & MPOOL_SMALL)
+        size = small_size(p, addr);
+    if (!size && (p->flags & MPOOL_GUARD))
+        size = guard_size(p, addr);
+    pthread_mutex_unlock(&p->lock);
+    return size;
+}
+
+/* Allocate `n` blocks of `size` bytes into out[], returning how many
+   were allocated. One free block big enough for all of them is found
+   and carved up in a single step when there is one; otherwise the
+   blocks are allocated one at a time under the same lock */
+int mpool_alloc_batch(struct memory_pool *p, size_t size, int n, void *out[])
+{
+    size_t align = calc_align(size);
+    size_t stride;
+    struct alloc_info *block = NULL, *obj;
+    size_t offset, used;
+    char *addr;
+    int i = 0, j;
+
+    if (!size || n <= 0) return 0;
+    // The whole batch is looked for as one block of stride * n bytes
+    if (size > PTRDIFF_MAX / n - align) {
+        POOL_ERROR("ERROR: failed to allocate %d blocks of %lu bytes: too large\n", n, size);
+        return 0;
+    }
+    stride = align_address(align, size);
+    pthread_mutex_lock(&p->lock);
+
+    if (p->policy != MPOOL_BUDDY && !small_fits(p, size, align))
+        block = find_free(p, stride * n, align);
+    if (block) {
+        offset = block->offset;
+        used = block_pad(block, align) + stride * n;
+        if (!os_commit(block->arena->start, &block->arena->committed, offset + used,
+                    block->arena->reserved, p->flags))
+            block = NULL;
+    }
+
+    if (block) {
+        char *base = block->arena->start;
+
+        addr = base + offset + block_pad(block, align);
+        for (; i < n; i++, addr += stride) {
+            obj = block_create(p, block->arena, offset, addr + stride - (base + offset), size);
+            if (!obj) break;
+            if (!tag_insert(p, addr, obj)) {
+                block_release(p, obj);
+                break;
+            }
+            obj->pad = addr - (base + offset);
+            obj->node = list_append(p->alloc_list, obj);
+            stat_alloc(p, size, obj->size);
+            obj->prev = block->prev;
+            obj->next = block;
+            if (block->prev) block->prev->next = obj;
+            block->prev = obj;
+            offset += obj->size;
+            out[i] = addr;
+        }
+
+        free_remove(p, block);
+        if (offset == block->offset + block->size) {
+            block->prev->next = block->next;
+            if (block->next) block->next->prev = block->prev;
+            list_remove(p->free_list, block->node);
+            block_release(p, block);
+        }
+        else {
+            block->size -= offset - block->offset;
+            block->offset = offset;
+            free_insert(p, block);
+        }
+    }
+
+    for (; i < n; i++) {
+        out[i] = pool_alloc(p, size, align);
+        if (!out[i]) break;
+    }
+
+    for (j = 0; p->trace && j < i; j++)
+        trace_alloc(p, out[j], size);
+    pthread_mutex_unlock(&p->lock);
+    return i;
+}
+
+/* Free the `n` blocks in ptrs[] under one lock. The blocks are first
+   all marked free and then merged in a single pass: each run of
+   adjacent free blocks is folded into its leftmost block once, however
+   many of the freed blocks it contains */
+void mpool_free_batch(struct memory_pool *p, void *ptrs[], int n)
+{
+    struct alloc_info *block, *left, *next, *merged = NULL;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; p->trace && i < n; i++)
+        if (ptrs[i]) trace_free(p, ptrs[i]);
+
+    if (p->policy == MPOOL_BUDDY || p->policy == MPOOL_ARENA || (p->flags & (MPOOL_SMALL | MPOOL_DEFER | MPOOL_GUARD))) {
+        for (i = 0; i < n; i++)
+            if (ptrs[i]) pool_free(p, ptrs[i]);
+        pthread_mutex_unlock(&p->lock);
         return;
     }
 
-    // Move block from allocated to free
-    dbll_remove(p->alloc_list, node);
-    dbll_append(p->free_list, block);
-    coalesce_free(p);
-}
-
-void coalesce_free(struct memory_pool *p)
-{
-    if (!p->free_list->first || !p->free_list->first->next) return;
-
-    struct llnode *node1 = p->free_list->first;
-    struct llnode *node2 = p->free_list->first;
-    struct llnode *tmp;
-    struct alloc_info *block1;
-    struct alloc_info *block2;
-
-    while(node1) {
-        block1 = (struct alloc_info *) node1->user_data;
-        while (node2) {
-            tmp = node2->next;
-            block2 = (struct alloc_info *) node2->user_data;
-            if (block1->offset + block1->size == block2->offset
-                    || block1->offset + block1->size + 1 == block2->offset) {
-                // Merge block2 into block1
-                block1->size += block2->size;
-                dbll_remove(p->free_list, node2);
+    for (i = 0; i < n; i++) {
+        block = ptrs[i] ? pool_find(p, ptrs[i]) : NULL;
+        if (!block || block->is_free) {
+            if (ptrs[i]) POOL_ERROR("ERROR: cannot free unallocated address\n");
+            continue;
+        }
+        stat_free(p, block->size);
+        list_remove(p->alloc_list, block->node);
+        block->node = NULL;
+        block->request_size = 0;
+        block->pad = 0;
+        block->is_free = 1;
+        block->dirty_lo = block->offset;
+        block->dirty_hi = block->offset + block->size;
+    }
+
+    for (i = 0; i < n; i++) {
+        block = ptrs[i] ? tag_remove(p, ptrs[i]) : NULL;
+        // Skip blocks already folded into a run: only those have a node
+        if (!block || block->node) continue;
+
+        for (left = block; left->prev && left->prev->is_free; left = left->prev)
+            ;
+        if (left->node) free_remove(p, left);
+        while ((next = left->next) && next->is_free) {
+            if (next->node) {
+                free_remove(p, next);
+                list_remove(p->free_list, next->node);
             }
-            node2 = tmp;
+            left->size += next->size;
+            dirty_absorb(p, left, next);
+            left->next = next->next;
+            if (next->next) next->next->prev = left;
+            // Keep the record until the pass is over, the batch may still name it
+            next->node = (struct llnode *) next;
+            next->bin_next = merged;
+            merged = next;
         }
-        node1 = node1->next;
-        node2 = node1;
+        if (!left->node)
+            left->node = list_append(p->free_list, left);
+        dirty_add(p, left, left->dirty_lo, left->dirty_hi);
+        free_insert(p, left);
+    }
+
+    while (merged) {
+        next = merged->bin_next;
+        block_release(p, merged);
+        merged = next;
     }
+    pthread_mutex_unlock(&p->lock);
 }
 
 void print_list(struct dbll *list)
@@ -1,20 +1,289 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
 #include "dbll.h"
 
+/* free blocks are kept in segregated lists by size class: 8-byte steps
+   below 64 bytes, then four classes per power of two */
+#define MPOOL_NBINS 240
+#define MPOOL_BIN_WORDS ((MPOOL_NBINS + 63) / 64)
+
+/* MPOOL_SMALL size classes: 8 bytes, then 16 to 256 in steps of 16 */
+#define MPOOL_SMALL_MAX 256
+#define MPOOL_SMALL_CLASSES 17
+
+/* allocations are counted by size in power-of-two classes: class i
+   holds requests of more than 1 << (i - 1) and at most 1 << i bytes */
+#define MPOOL_STAT_CLASSES 32
+
+/* MPOOL_GUARD: allocations of up to a page are sampled onto one of
+   MPOOL_GUARD_SLOTS pages that each sit between inaccessible guard pages */
+#define MPOOL_GUARD_SLOTS 128
+#define MPOOL_GUARD_RATE 5000
+
+/* allocation trace file: MPOOL_TRACE_MAGIC, then one record per call */
+#define MPOOL_TRACE_MAGIC "MPTRACE1"
+
+enum mpool_trace_op {
+  MPOOL_TRACE_ALLOC,          /* allocation number `id` of `size` bytes */
+  MPOOL_TRACE_FREE,           /* allocation `id` is freed */
+  MPOOL_TRACE_REALLOC,        /* allocation `id` is resized to `size` bytes */
+};
+
+struct mpool_trace_rec {
+  uint64_t time_ns;           /* since the trace started */
+  uint64_t size;
+  uint32_t id;
+  uint32_t op;                /* enum mpool_trace_op */
+};
+
+/* one contiguous region of a pool; a pool that may grow chains more of
+   them behind the first one */
+struct mpool_arena {
+  char *start;                /* start of the region */
+  size_t size;                /* usable bytes */
+  size_t reserved;            /* address space reserved at start */
+  size_t committed;           /* bytes from start that are usable so far */
+  struct mpool_arena *next;
+};
+
 struct alloc_info {
-  size_t offset;     /* offset from beginning of pool */
+  size_t offset;     /* offset from beginning of the block's arena */
   size_t size;       /* size of allocation */
   size_t request_size; /* size actually requested */
+  size_t pad;        /* alignment padding between offset and the returned address */
+  int is_free;       /* block is on the free_list */
+  int is_run;        /* allocated block holding small-block slots (pa_small.c) */
+  unsigned long freed_at; /* while free: pool clock when it last took freed memory */
+  size_t dirty_lo;   /* while free: arena offsets [dirty_lo, dirty_hi) may hold */
+  size_t dirty_hi;   /* pages not yet given back to the system (pa_maint.c) */
+  struct alloc_info *dirty_prev; /* neighbours in the pool's queue of dirty free blocks */
+  struct alloc_info *dirty_next;
+  struct mpool_arena *arena;   /* region the block belongs to */
+  struct llnode *node;         /* node on alloc_list or free_list */
+  struct llnode link;          /* storage for node */
+  struct alloc_info *prev;     /* physically adjacent blocks (boundary tags) */
+  struct alloc_info *next;
+  struct alloc_info *bin_prev; /* neighbours in the size-class list while free */
+  struct alloc_info *bin_next;
+  struct alloc_info *left;     /* children in the best-fit tree while free */
+  struct alloc_info *right;
+  int height;
+};
+
+/* entry in the tag table that maps a returned address to its block */
+struct mpool_tag {
+  uintptr_t addr;
+  struct alloc_info *block;
+};
+
+/* how mpool_alloc picks a free block */
+enum mpool_policy {
+  MPOOL_SEGREGATED,   /* O(1) good fit from size-class lists (default) */
+  MPOOL_BESTFIT,      /* smallest fitting block from a size-ordered tree, O(log n) */
+  MPOOL_BUDDY,        /* power-of-two blocks split and merged by XOR on offsets */
+  MPOOL_ARENA,        /* bump allocation, frees are no-ops, mpool_reset releases all */
+};
+
+/* mpool_opts flags */
+#define MPOOL_HUGE_THP      0x1  /* back the pool with transparent huge pages */
+#define MPOOL_HUGE_EXPLICIT 0x2  /* use hugetlbfs pages, falling back to THP */
+#define MPOOL_GROW          0x4  /* add arenas instead of failing when full */
+#define MPOOL_SMALL         0x8  /* serve requests of up to 256 bytes from bitmap runs */
+#define MPOOL_DEFER         0x10 /* queue frees and merge them later (not with MPOOL_BUDDY) */
+#define MPOOL_GUARD         0x20 /* put sampled allocations between guard pages */
+
+struct mpool_opts {
+  enum mpool_policy policy;
+  unsigned flags;
+  size_t max_size;   /* with MPOOL_GROW, cap on the total size of all arenas (0: none) */
+  unsigned guard_rate; /* with MPOOL_GUARD, guard about 1 in this many allocations (0: MPOOL_GUARD_RATE) */
+  unsigned decay_ms; /* with a maintenance thread, purge free pages idle this long (0: never) */
 };
 
 struct memory_pool {
   char *start;                /* start of pool */
   size_t size;                /* size of pool */
+  struct mpool_arena *arenas; /* the arena at start, then any added by growth */
+  size_t total_size;          /* size of all arenas together */
+  size_t max_size;            /* growth cap, 0 for none */
+  unsigned flags;             /* mpool_opts flags */
   struct dbll *alloc_list;    /* track allocations */
   struct dbll *free_list;     /* list of freed regions */
+  struct dbll alloc_head;     /* storage for alloc_list */
+  struct dbll free_head;      /* storage for free_list */
+  struct alloc_info *bins[MPOOL_NBINS];  /* free blocks by size class */
+  uint64_t bin_map[MPOOL_BIN_WORDS];     /* bit set for every non-empty bin */
+  struct alloc_info *tree;    /* free blocks by size under MPOOL_BESTFIT */
+  enum mpool_policy policy;
+  struct mpool_tag *tags;     /* open-addressed table of allocated blocks */
+  size_t tag_cap;             /* slots in tags, a power of two */
+  size_t tag_count;           /* used slots in tags */
+  struct alloc_info *meta_free; /* unused block records (pa_meta.c) */
+  void *meta_chunks;          /* memory the block records come from */
+  struct mpool_arena *bump_arena; /* MPOOL_ARENA: arena being bumped through */
+  size_t bump;                /* MPOOL_ARENA: offset of the next free byte in it */
+  void *last;                 /* MPOOL_ARENA: most recent allocation */
+  size_t in_use;              /* bytes in allocated blocks, padding included */
+  size_t high_water;          /* largest in_use so far */
+  unsigned long nalloc;       /* cumulative counters for mpool_stats */
+  unsigned long nfree;
+  unsigned long nfail;
+  unsigned long size_hist[MPOOL_STAT_CLASSES];
+  struct small_run *small[MPOOL_SMALL_CLASSES]; /* MPOOL_SMALL: runs with free slots per class */
+  struct mpool_trace *trace;  /* trace being recorded, if any (pa_trace.c) */
+  struct alloc_info *deferred; /* MPOOL_DEFER: frees not merged yet, through bin_next */
+  size_t ndeferred;
+  pthread_t maint;            /* maintenance thread (pa_maint.c) */
+  pthread_cond_t maint_cond;  /* wakes it early to stop */
+  int maint_on;
+  unsigned maint_ms;          /* interval between maintenance passes */
+  unsigned decay_ms;          /* mpool_opts decay_ms */
+  unsigned long clock;        /* ms of maintenance passes, for decay_ms */
+  struct alloc_info *dirty_first; /* free blocks with pages to give back, oldest first */
+  struct alloc_info *dirty_last;
+  size_t purged;              /* bytes handed back to the system so far */
+  struct mpool_file *file;    /* header of the pool's file, if it has one (pa_file.c) */
+  size_t root;                /* mpool_off of the object mpool_set_root named */
+  struct mpool_guard *guard;  /* MPOOL_GUARD: guarded slots (pa_guard.c) */
+  unsigned guard_left;        /* MPOOL_GUARD: allocations until the next guarded one */
+  pthread_mutex_t lock;       /* serializes every operation on the pool */
+};
+
+/* snapshot of a pool's state, filled in by mpool_stats. Blocks held
+   by a tcache or slab count as in use. */
+struct mpool_stats {
+  size_t total;               /* bytes in all arenas */
+  size_t in_use;              /* bytes handed out, alignment padding included */
+  size_t free;                /* bytes available for allocation */
+  size_t largest_free;        /* largest single free block */
+  size_t free_blocks;         /* number of free blocks */
+  size_t deferred;            /* bytes freed but not merged yet (MPOOL_DEFER) */
+  size_t purged;              /* bytes of free memory handed back to the system so far */
+  double fragmentation;       /* 1 - largest_free / free; 0 when nothing is free */
+  size_t high_water;          /* peak of in_use */
+  unsigned long allocs;       /* successful allocations */
+  unsigned long frees;
+  unsigned long failures;     /* allocations that returned NULL */
+  unsigned long size_hist[MPOOL_STAT_CLASSES]; /* allocations per size class */
+};
+
+/* per-thread cache in front of a shared pool: blocks of up to
+   MPOOL_TCACHE_MAX bytes are kept in a magazine per 16-byte size class
+   and exchanged with the pool MPOOL_TCACHE_BATCH at a time, so the
+   common alloc/free path takes no lock. Only the thread that created a
+   tcache may allocate from it, but any thread may free to it: frees
+   from other threads go onto a lock-free queue of MPOOL_TCACHE_REMOTE
+   entries that the owner drains on its next allocation. The tcache
+   must outlive those frees. */
+#define MPOOL_TCACHE_CLASSES 16
+#define MPOOL_TCACHE_MAX (MPOOL_TCACHE_CLASSES * 16)
+#define MPOOL_TCACHE_SLOTS 64
+#define MPOOL_TCACHE_BATCH 32
+#define MPOOL_TCACHE_REMOTE 256
+
+struct mpool_magazine {
+  unsigned count;
+  void *slots[MPOOL_TCACHE_SLOTS];
+};
+
+struct mpool_tcache {
+  struct memory_pool *pool;
+  struct mpool_magazine mags[MPOOL_TCACHE_CLASSES];
+  unsigned npending;                    /* frees not yet sorted by class */
+  void *pending[MPOOL_TCACHE_SLOTS];
+  pthread_t owner;
+  /* remote frees: a bounded ring where a slot is free for the producer
+     at position n when seq == n and full for the owner when seq == n + 1 */
+  unsigned long remote_head;            /* owner only */
+  unsigned long remote_tail;            /* producers, atomically */
+  struct {
+    unsigned long seq;
+    void *addr;
+  } remote[MPOOL_TCACHE_REMOTE];
+};
+
+/* fixed-size object allocator carving pages obtained from a pool into
+   equal slots; free slots are chained through their own first word, so
+   objects carry no header. A slab is not synchronized: use one per
+   thread or guard it. */
+struct mpool_slab {
+  struct memory_pool *pool;   /* backing store for the pages */
+  size_t slot_size;           /* object size rounded up to the alignment */
+  size_t align;
+  size_t page_size;           /* bytes requested from the pool per page */
+  void *free;                 /* first free slot */
+  void *pages;                /* pages chained through their first word */
 };
 
 struct memory_pool *mpool_create(size_t size);
+struct memory_pool *mpool_create_opts(size_t size, const struct mpool_opts *opts);
 void mpool_destroy(struct memory_pool *p);
+void mpool_reset(struct memory_pool *p);
 void *mpool_alloc(struct memory_pool *p, size_t size);
+void *mpool_alloc_aligned(struct memory_pool *p, size_t size, size_t align);
 void mpool_free(struct memory_pool *p, void *addr);
+void *mpool_realloc(struct memory_pool *p, void *addr, size_t size);
+size_t mpool_usable_size(struct memory_pool *p, void *addr);
+int mpool_alloc_batch(struct memory_pool *p, size_t size, int n, void *out[]);
+void mpool_free_batch(struct memory_pool *p, void *ptrs[], int n);
+void mpool_coalesce(struct memory_pool *p);
+size_t mpool_purge(struct memory_pool *p);
+int mpool_maintain_start(struct memory_pool *p, unsigned interval_ms);
+void mpool_maintain_stop(struct memory_pool *p);
+void mpool_stats(struct memory_pool *p, struct mpool_stats *out);
+void mpool_stats_print(struct memory_pool *p, FILE *out);
+int mpool_trace_start(struct memory_pool *p, const char *path);
+void mpool_trace_stop(struct memory_pool *p);
+
+struct memory_pool *mpool_open_file(const char *path, size_t size);
+void mpool_set_root(struct memory_pool *p, void *obj);
+void *mpool_root(struct memory_pool *p);
+
+/* Offsets of objects in a pool, taken from the pool itself, so that a
+   structure linked by offsets reads the same in any mapping of a
+   file-backed pool; offset 0 stands for NULL. */
+static inline size_t mpool_off(struct memory_pool *p, const void *ptr)
+{
+  return ptr ? (uintptr_t) ptr - (uintptr_t) p : 0;
+}
+
+static inline void *mpool_ptr(struct memory_pool *p, size_t off)
+{
+  return off ? (char *) p + off : NULL;
+}
+
+struct mpool_tcache *mpool_tcache_create(struct memory_pool *p);
+void mpool_tcache_destroy(struct mpool_tcache *tc);
+void *mpool_tcache_alloc(struct mpool_tcache *tc, size_t size);
+void mpool_tcache_free(struct mpool_tcache *tc, void *addr);
+
+/* MPOOL_NEW(tc, type): allocate one `type` from a tcache, to be freed
+   with mpool_tcache_free. The size class is worked out at compile time
+   and a hit pops the magazine inline; a miss, pending remote frees, or
+   a type that needs more than 16-byte alignment go out of line. */
+#define MPOOL_NEW(tc, type) \
+  ((type *) mpool_tcache_new((tc), sizeof(type), __alignof__(type)))
+
+static inline void *mpool_tcache_new(struct mpool_tcache *tc, size_t size, size_t align)
+{
+  struct mpool_magazine *mag;
+  unsigned long head = tc->remote_head;
+
+  if (align > 16)
+    return mpool_alloc_aligned(tc->pool, size, align);
+  if (size && size <= MPOOL_TCACHE_MAX) {
+    mag = &tc->mags[(size - 1) / 16];
+    if (mag->count &&
+        __atomic_load_n(&tc->remote[head % MPOOL_TCACHE_REMOTE].seq, __ATOMIC_RELAXED) != head + 1)
+      return mag->slots[--mag->count];
+  }
+  return mpool_tcache_alloc(tc, size);
+}
+
+struct mpool_slab *mpool_slab_create(struct memory_pool *p, size_t obj_size, size_t align);
+void mpool_slab_destroy(struct mpool_slab *s);
+void *mpool_slab_alloc(struct mpool_slab *s);
+void mpool_slab_free(struct mpool_slab *s, void *obj);